@@ -0,0 +1,6 @@
+#!/bin/bash
+# builds fsbench optimized and runs it, passing along any options; the JSON
+# report goes to standard output
+FS_SRCS="filesystem.c blockcache.c softwaredisk.c"
+FS_LIBS="-pthread"
+gcc -O2 -o fsbench fsbench.c $FS_SRCS $FS_LIBS && ./fsbench "$@"
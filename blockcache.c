@@ -0,0 +1,745 @@
+//
+// Write-back block buffer cache layered between the filesystem and the
+// software disk.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include "softwaredisk.h"
+#include "blockcache.h"
+
+#define NO_SLOT -1
+
+// one cached block
+typedef struct CacheSlot {
+  unsigned long blocknum;
+  int valid;
+  int dirty;
+  int pins;           // pin_cache_block() calls not yet released; never evicted while set
+  int loading;        // being read in from the software disk without cache_lock
+  int prev, next;     // LRU list, most recently used at head
+  int hashnext;       // chain of slots in the same hash bucket
+} CacheSlot;
+
+// internals of block cache implementation
+typedef struct BlockCacheInternals {
+  unsigned long numslots;
+  unsigned long numbuckets;    // power of two
+  CacheSlot *slots;
+  int *buckets;
+  unsigned char *data;         // numslots blocks, slot i at i * block size
+  int head, tail;
+  unsigned long numpinned;     // slots with pins set
+  BlockCacheStats stats;
+} BlockCacheInternals;
+
+//
+// GLOBALS
+//
+
+static BlockCacheInternals bc;
+
+// guards everything in 'bc'; never held across a software disk read or a
+// multi-block write, so transfers from different threads overlap.  A slot
+// being read in is pinned and marked loading while the lock is dropped.
+static pthread_mutex_t cache_lock=PTHREAD_MUTEX_INITIALIZER;
+
+// signalled with cache_lock when slots finish loading
+static pthread_cond_t slot_loaded=PTHREAD_COND_INITIALIZER;
+
+static int exit_hook_registered;
+
+static unsigned long hash_block(unsigned long blocknum) {
+  return (blocknum * 2654435761UL) & (bc.numbuckets - 1);
+}
+
+static unsigned char *slot_data(int slot) {
+  return bc.data + (unsigned long)slot * SOFTWARE_DISK_BLOCK_SIZE;
+}
+
+static void lru_unlink(int slot) {
+  CacheSlot *s=&bc.slots[slot];
+  if (s->prev != NO_SLOT) {
+    bc.slots[s->prev].next=s->next;
+  }
+  else {
+    bc.head=s->next;
+  }
+  if (s->next != NO_SLOT) {
+    bc.slots[s->next].prev=s->prev;
+  }
+  else {
+    bc.tail=s->prev;
+  }
+  s->prev=s->next=NO_SLOT;
+}
+
+static void lru_push_head(int slot) {
+  CacheSlot *s=&bc.slots[slot];
+  s->prev=NO_SLOT;
+  s->next=bc.head;
+  if (bc.head != NO_SLOT) {
+    bc.slots[bc.head].prev=slot;
+  }
+  bc.head=slot;
+  if (bc.tail == NO_SLOT) {
+    bc.tail=slot;
+  }
+}
+
+static void hash_remove(int slot) {
+  int *link=&bc.buckets[hash_block(bc.slots[slot].blocknum)];
+  while (*link != NO_SLOT) {
+    if (*link == slot) {
+      *link=bc.slots[slot].hashnext;
+      break;
+    }
+    link=&bc.slots[*link].hashnext;
+  }
+  bc.slots[slot].hashnext=NO_SLOT;
+}
+
+static void hash_insert(int slot) {
+  unsigned long bucket=hash_block(bc.slots[slot].blocknum);
+  bc.slots[slot].hashnext=bc.buckets[bucket];
+  bc.buckets[bucket]=slot;
+}
+
+static int lookup_slot(unsigned long blocknum) {
+  int slot=bc.buckets[hash_block(blocknum)];
+  while (slot != NO_SLOT && bc.slots[slot].blocknum != blocknum) {
+    slot=bc.slots[slot].hashnext;
+  }
+  return slot;
+}
+
+// like lookup_slot(), but waits for a slot that another thread is reading in
+static int lookup_loaded_slot(unsigned long blocknum) {
+  int slot=lookup_slot(blocknum);
+
+  while (slot != NO_SLOT && bc.slots[slot].loading) {
+    pthread_cond_wait(&slot_loaded, &cache_lock);
+    slot=lookup_slot(blocknum);
+  }
+  return slot;
+}
+
+static int write_back_slot(int slot) {
+  if (! write_sd_block(slot_data(slot), bc.slots[slot].blocknum)) {
+    return 0;
+  }
+  bc.slots[slot].dirty=0;
+  bc.stats.writebacks++;
+  return 1;
+}
+
+static int init_cache_locked(unsigned long numblocks);
+static int write_back_cache_locked(void);
+static int flush_cache_locked(void);
+
+static void flush_at_exit(void) {
+  flush_block_cache();
+}
+
+static int ensure_cache(void) {
+  if (bc.slots) {
+    return 1;
+  }
+  return init_cache_locked(BLOCK_CACHE_DEFAULT_BLOCKS);
+}
+
+// claims the least recently used slot that isn't pinned for 'blocknum',
+// writing back its old contents first if dirty.  The slot is left at the head
+// of the LRU list.
+static int claim_slot(unsigned long blocknum) {
+  int slot=bc.tail;
+  CacheSlot *s;
+
+  while (slot != NO_SLOT && bc.slots[slot].pins > 0) {
+    slot=bc.slots[slot].prev;
+  }
+  if (slot == NO_SLOT) {
+    sderror=SD_INTERNAL_ERROR;
+    return NO_SLOT;
+  }
+  s=&bc.slots[slot];
+  if (s->valid) {
+    if (s->dirty && ! write_back_slot(slot)) {
+      return NO_SLOT;
+    }
+    hash_remove(slot);
+    bc.stats.evictions++;
+  }
+  s->blocknum=blocknum;
+  s->valid=1;
+  s->dirty=0;
+  hash_insert(slot);
+  lru_unlink(slot);
+  lru_push_head(slot);
+  return slot;
+}
+
+// claims a slot for 'blocknum' like claim_slot(), pinned and marked loading so
+// the caller can read it in with cache_lock dropped.
+static int claim_loading_slot(unsigned long blocknum) {
+  int slot=claim_slot(blocknum);
+
+  if (slot != NO_SLOT) {
+    bc.slots[slot].loading=1;
+    if (bc.slots[slot].pins++ == 0) {
+      bc.numpinned++;
+    }
+  }
+  return slot;
+}
+
+// publishes a slot from claim_loading_slot() once it has been read in, or
+// drops it if the read failed, and wakes anyone waiting for it.
+static void finish_loading_slot(int slot, int ok) {
+  CacheSlot *s=&bc.slots[slot];
+
+  s->loading=0;
+  if (--s->pins == 0) {
+    bc.numpinned--;
+  }
+  if (! ok) {
+    hash_remove(slot);
+    s->valid=0;
+  }
+  pthread_cond_broadcast(&slot_loaded);
+}
+
+// returns the slot holding 'blocknum', reading it in from the software disk
+// if it isn't cached, or NO_SLOT on failure.  Called with cache_lock held,
+// which is dropped during the read.
+static int load_slot(unsigned long blocknum) {
+  int slot, ok;
+
+  slot=lookup_loaded_slot(blocknum);
+  if (slot != NO_SLOT) {
+    bc.stats.hits++;
+    lru_unlink(slot);
+    lru_push_head(slot);
+    return slot;
+  }
+  bc.stats.misses++;
+  slot=claim_loading_slot(blocknum);
+  if (slot == NO_SLOT) {
+    return NO_SLOT;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  ok=read_sd_block(slot_data(slot), blocknum);
+  pthread_mutex_lock(&cache_lock);
+  finish_loading_slot(slot, ok);
+  return ok ? slot : NO_SLOT;
+}
+
+static int compare_slots_by_block(const void *a, const void *b) {
+  unsigned long x=bc.slots[*(const int *)a].blocknum;
+  unsigned long y=bc.slots[*(const int *)b].blocknum;
+  return (x > y) - (x < y);
+}
+
+// (re)sizes the cache to hold 'numblocks' blocks, flushing and dropping
+// anything currently cached.  Returns 1 on success or 0 on failure.
+int init_block_cache(unsigned long numblocks) {
+  int ret;
+
+  pthread_mutex_lock(&cache_lock);
+  ret=init_cache_locked(numblocks);
+  pthread_mutex_unlock(&cache_lock);
+  return ret;
+}
+
+static int init_cache_locked(unsigned long numblocks) {
+  unsigned long i;
+
+  if (numblocks == 0) {
+    numblocks=1;
+  }
+  if (bc.numpinned > 0) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  if (bc.slots && ! flush_cache_locked()) {
+    return 0;
+  }
+  free(bc.slots);
+  free(bc.buckets);
+  free(bc.data);
+  bzero(&bc, sizeof(bc));
+
+  bc.numbuckets=1;
+  while (bc.numbuckets < numblocks) {
+    bc.numbuckets <<= 1;
+  }
+  bc.slots=malloc(numblocks * sizeof(CacheSlot));
+  bc.buckets=malloc(bc.numbuckets * sizeof(int));
+  bc.data=malloc(numblocks * SOFTWARE_DISK_BLOCK_SIZE);
+  if (! bc.slots || ! bc.buckets || ! bc.data) {
+    free(bc.slots);
+    free(bc.buckets);
+    free(bc.data);
+    bzero(&bc, sizeof(bc));
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+
+  bc.numslots=numblocks;
+  bc.head=bc.tail=NO_SLOT;
+  for (i=0; i < bc.numbuckets; i++) {
+    bc.buckets[i]=NO_SLOT;
+  }
+  for (i=0; i < numblocks; i++) {
+    bc.slots[i].valid=0;
+    bc.slots[i].dirty=0;
+    bc.slots[i].pins=0;
+    bc.slots[i].loading=0;
+    bc.slots[i].hashnext=NO_SLOT;
+    lru_push_head(i);
+  }
+
+  if (! exit_hook_registered) {
+    atexit(flush_at_exit);
+    exit_hook_registered=1;
+  }
+  return 1;
+}
+
+// reads block 'blocknum' into 'buf', from the cache if present, otherwise from
+// the software disk.  Returns 1 on success or 0 on failure.
+int read_cache_block(void *buf, unsigned long blocknum) {
+  int slot;
+
+  pthread_mutex_lock(&cache_lock);
+  if (! ensure_cache()) {
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+  }
+  slot=load_slot(blocknum);
+  if (slot == NO_SLOT) {
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+  }
+  memcpy(buf, slot_data(slot), SOFTWARE_DISK_BLOCK_SIZE);
+  pthread_mutex_unlock(&cache_lock);
+  sderror=SD_NONE;
+  return 1;
+}
+
+// copies 'buf' into the cached copy of block 'blocknum' and marks it dirty.
+// Returns 1 on success or 0 on failure.
+int write_cache_block(void *buf, unsigned long blocknum) {
+  int slot;
+
+  if (blocknum >= software_disk_size()) {
+    sderror=SD_ILLEGAL_BLOCK_NUMBER;
+    return 0;
+  }
+  pthread_mutex_lock(&cache_lock);
+  if (! ensure_cache()) {
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+  }
+  slot=lookup_loaded_slot(blocknum);
+  if (slot != NO_SLOT) {
+    bc.stats.hits++;
+    lru_unlink(slot);
+    lru_push_head(slot);
+  }
+  else {
+    // whole-block write, nothing to read in first
+    slot=claim_slot(blocknum);
+    if (slot == NO_SLOT) {
+      pthread_mutex_unlock(&cache_lock);
+      return 0;
+    }
+  }
+  memcpy(slot_data(slot), buf, SOFTWARE_DISK_BLOCK_SIZE);
+  bc.slots[slot].dirty=1;
+  pthread_mutex_unlock(&cache_lock);
+  sderror=SD_NONE;
+  return 1;
+}
+
+// pins block 'blocknum' in the cache, reading it in from the software disk if
+// it isn't cached, and returns a read-only pointer to the cached copy, or NULL
+// on failure.
+const void *pin_cache_block(unsigned long blocknum) {
+  int slot;
+
+  pthread_mutex_lock(&cache_lock);
+  if (! ensure_cache()) {
+    pthread_mutex_unlock(&cache_lock);
+    return NULL;
+  }
+  slot=load_slot(blocknum);
+  if (slot == NO_SLOT) {
+    pthread_mutex_unlock(&cache_lock);
+    return NULL;
+  }
+  if (bc.slots[slot].pins++ == 0) {
+    bc.numpinned++;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  sderror=SD_NONE;
+  return slot_data(slot);
+}
+
+// releases one pin_cache_block() of block 'blocknum'.
+void unpin_cache_block(unsigned long blocknum) {
+  int slot;
+
+  pthread_mutex_lock(&cache_lock);
+  slot=bc.slots ? lookup_slot(blocknum) : NO_SLOT;
+  if (slot != NO_SLOT && bc.slots[slot].pins > 0 && --bc.slots[slot].pins == 0) {
+    bc.numpinned--;
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+// reads the uncached blocks among 'count' consecutive blocks starting at
+// 'blocknum' into the cache with one software disk request, made without
+// cache_lock.  At most half the cache is filled, so the blocks don't evict
+// each other.  Returns 1 on success or 0 on failure.
+int prefetch_cache_blocks(unsigned long blocknum, unsigned long count) {
+  void **bufs;
+  unsigned long *blocknums;
+  int *slots;
+  unsigned long i, n=0;
+  int slot, ret=1;
+
+  pthread_mutex_lock(&cache_lock);
+  if (! ensure_cache()) {
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+  }
+  if (count > (bc.numslots - bc.numpinned) / 2) {
+    count=(bc.numslots - bc.numpinned) / 2;
+  }
+  bufs=malloc(count * sizeof(void *) + 1);
+  blocknums=malloc(count * sizeof(unsigned long) + 1);
+  slots=malloc(count * sizeof(int) + 1);
+  if (! bufs || ! blocknums || ! slots) {
+    pthread_mutex_unlock(&cache_lock);
+    free(bufs);
+    free(blocknums);
+    free(slots);
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  for (i=0; i < count; i++) {
+    if (lookup_slot(blocknum + i) != NO_SLOT) {
+      continue;
+    }
+    slot=claim_loading_slot(blocknum + i);
+    if (slot == NO_SLOT) {
+      ret=0;
+      break;
+    }
+    slots[n]=slot;
+    bufs[n]=slot_data(slot);
+    blocknums[n++]=blocknum + i;
+  }
+  if (ret && n > 0) {
+    bc.stats.misses += n;
+    pthread_mutex_unlock(&cache_lock);
+    ret=readv_sd_blocks(bufs, blocknums, n);
+    pthread_mutex_lock(&cache_lock);
+  }
+  // on failure whatever was claimed holds nothing useful
+  for (i=0; i < n; i++) {
+    finish_loading_slot(slots[i], ret);
+  }
+  pthread_mutex_unlock(&cache_lock);
+  free(bufs);
+  free(blocknums);
+  free(slots);
+  if (ret) {
+    sderror=SD_NONE;
+  }
+  return ret;
+}
+
+// refreshes the cached copies of 'count' blocks starting at 'blocknum' from
+// 'buf', marking them 'dirty' or clean.
+static void refresh_cached_blocks(unsigned char *buf, unsigned long blocknum, unsigned long count, int dirty) {
+  unsigned long i;
+  int slot;
+
+  for (i=0; i < count; i++) {
+    slot=lookup_loaded_slot(blocknum + i);
+    if (slot != NO_SLOT) {
+      memcpy(slot_data(slot), buf + i * SOFTWARE_DISK_BLOCK_SIZE, SOFTWARE_DISK_BLOCK_SIZE);
+      bc.slots[slot].dirty=dirty;
+    }
+  }
+}
+
+// upper bound on the software disk requests read_cache_runs() makes for 'runs'
+static unsigned long max_requests(CacheRun *runs, unsigned long numruns) {
+  unsigned long i, n=0;
+
+  for (i=0; i < numruns; i++) {
+    if (runs[i].count > 1) {
+      n += runs[i].count / 2 + 1;
+    }
+  }
+  return n;
+}
+
+// reads every run in 'runs'.  Cached blocks of multi-block runs are copied
+// from the cache and their uncached stretches are submitted to the software
+// disk together, without being added to the cache.  Single-block runs are
+// read like read_cache_block() while those requests are in flight.  Returns 1
+// on success or 0 on failure.
+int read_cache_runs(CacheRun *runs, unsigned long numruns) {
+  SDRequest *reqs;
+  unsigned char *p;
+  unsigned long i, j, run, numreqs=0;
+  int slot, ret=1;
+
+  reqs=malloc(max_requests(runs, numruns) * sizeof(SDRequest) + 1);
+  if (! reqs) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  pthread_mutex_lock(&cache_lock);
+  if (! ensure_cache()) {
+    pthread_mutex_unlock(&cache_lock);
+    free(reqs);
+    return 0;
+  }
+  for (i=0; i < numruns; i++) {
+    p=runs[i].buf;
+    j=0;
+    while (runs[i].count > 1 && j < runs[i].count) {
+      slot=lookup_loaded_slot(runs[i].blocknum + j);
+      if (slot != NO_SLOT) {
+	bc.stats.hits++;
+	memcpy(p + j * SOFTWARE_DISK_BLOCK_SIZE, slot_data(slot), SOFTWARE_DISK_BLOCK_SIZE);
+	j++;
+	continue;
+      }
+      run=1;
+      while (j + run < runs[i].count && lookup_slot(runs[i].blocknum + j + run) == NO_SLOT) {
+	run++;
+      }
+      bc.stats.misses += run;
+      reqs[numreqs].writing=0;
+      reqs[numreqs].buf=p + j * SOFTWARE_DISK_BLOCK_SIZE;
+      reqs[numreqs].blocknum=runs[i].blocknum + j;
+      reqs[numreqs].count=run;
+      numreqs++;
+      j += run;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  if (numreqs > 0 && ! submit_sd_requests(reqs, numreqs)) {
+    free(reqs);
+    return 0;
+  }
+  for (i=0; i < numruns; i++) {
+    if (runs[i].count == 1 && ! read_cache_block(runs[i].buf, runs[i].blocknum)) {
+      ret=0;
+    }
+  }
+  if (numreqs > 0 && ! wait_sd_requests(reqs, numreqs)) {
+    ret=0;
+  }
+  free(reqs);
+  if (ret) {
+    sderror=SD_NONE;
+  }
+  return ret;
+}
+
+// writes every run in 'runs'.  Multi-block runs are submitted to the software
+// disk together, refreshing any cached copies first, so a stale dirty copy
+// can't be written back over the new blocks while the transfers are in
+// flight.  Single-block runs are written like write_cache_block() meanwhile.
+// Returns 1 on success or 0 on failure.
+int write_cache_runs(CacheRun *runs, unsigned long numruns) {
+  SDRequest *reqs;
+  unsigned long i, numreqs=0;
+  int ret=1;
+
+  reqs=malloc(numruns * sizeof(SDRequest) + 1);
+  if (! reqs) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  pthread_mutex_lock(&cache_lock);
+  if (! ensure_cache()) {
+    pthread_mutex_unlock(&cache_lock);
+    free(reqs);
+    return 0;
+  }
+  for (i=0; i < numruns; i++) {
+    if (runs[i].count > 1) {
+      refresh_cached_blocks(runs[i].buf, runs[i].blocknum, runs[i].count, 0);
+      reqs[numreqs].writing=1;
+      reqs[numreqs].buf=runs[i].buf;
+      reqs[numreqs].blocknum=runs[i].blocknum;
+      reqs[numreqs].count=runs[i].count;
+      numreqs++;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  if (numreqs > 0 && ! submit_sd_requests(reqs, numreqs)) {
+    ret=0;
+    numreqs=0;
+  }
+  for (i=0; i < numruns; i++) {
+    if (runs[i].count == 1 && ! write_cache_block(runs[i].buf, runs[i].blocknum)) {
+      ret=0;
+    }
+  }
+  if (numreqs > 0 && ! wait_sd_requests(reqs, numreqs)) {
+    ret=0;
+  }
+  if (! ret) {
+    // the cached copies are the only up to date ones now
+    pthread_mutex_lock(&cache_lock);
+    for (i=0; i < numruns; i++) {
+      if (runs[i].count > 1) {
+	refresh_cached_blocks(runs[i].buf, runs[i].blocknum, runs[i].count, 1);
+      }
+    }
+    pthread_mutex_unlock(&cache_lock);
+  }
+  free(reqs);
+  if (ret) {
+    sderror=SD_NONE;
+  }
+  return ret;
+}
+
+// reads 'count' consecutive blocks starting at 'blocknum' into 'buf', as a
+// single run of read_cache_runs().  Returns 1 on success or 0 on failure.
+int read_cache_blocks(void *buf, unsigned long blocknum, unsigned long count) {
+  CacheRun run={ buf, blocknum, count };
+
+  return read_cache_runs(&run, 1);
+}
+
+// writes 'count' consecutive blocks from 'buf' starting at 'blocknum', as a
+// single run of write_cache_runs().  Returns 1 on success or 0 on failure.
+int write_cache_blocks(void *buf, unsigned long blocknum, unsigned long count) {
+  CacheRun run={ buf, blocknum, count };
+
+  return write_cache_runs(&run, 1);
+}
+
+// writes 'count' consecutive blocks from 'buf' starting at 'blocknum' straight
+// to the software disk, even a single block, refreshing any cached copies, and
+// syncs the software disk.  Returns 1 on success or 0 on failure.
+int write_cache_blocks_sync(void *buf, unsigned long blocknum, unsigned long count) {
+  int ret;
+
+  pthread_mutex_lock(&cache_lock);
+  if (! ensure_cache()) {
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+  }
+  refresh_cached_blocks(buf, blocknum, count, 0);
+  pthread_mutex_unlock(&cache_lock);
+
+  ret=write_sd_blocks(buf, blocknum, count) && sync_software_disk();
+  if (! ret) {
+    pthread_mutex_lock(&cache_lock);
+    refresh_cached_blocks(buf, blocknum, count, 1);
+    pthread_mutex_unlock(&cache_lock);
+  }
+  return ret;
+}
+
+// writes every dirty block back to the software disk in block order and syncs
+// the software disk.  Returns 1 on success or 0 on failure.
+int flush_block_cache(void) {
+  int ret;
+
+  pthread_mutex_lock(&cache_lock);
+  ret=flush_cache_locked();
+  pthread_mutex_unlock(&cache_lock);
+  return ret;
+}
+
+// writes every dirty block back to the software disk in block order, without
+// syncing it.  Returns 1 on success or 0 on failure.
+int write_back_block_cache(void) {
+  int ret;
+
+  pthread_mutex_lock(&cache_lock);
+  ret=write_back_cache_locked();
+  pthread_mutex_unlock(&cache_lock);
+  return ret;
+}
+
+static int flush_cache_locked(void) {
+  return write_back_cache_locked() && sync_software_disk();
+}
+
+static int write_back_cache_locked(void) {
+  int *dirty;
+  void **bufs;
+  unsigned long *blocknums;
+  unsigned long i, n=0;
+  int ret=1;
+
+  if (! bc.slots) {
+    return 1;
+  }
+  dirty=malloc(bc.numslots * sizeof(int));
+  bufs=malloc(bc.numslots * sizeof(void *));
+  blocknums=malloc(bc.numslots * sizeof(unsigned long));
+  if (! dirty || ! bufs || ! blocknums) {
+    free(dirty);
+    free(bufs);
+    free(blocknums);
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  for (i=0; i < bc.numslots; i++) {
+    if (bc.slots[i].valid && bc.slots[i].dirty) {
+      dirty[n++]=i;
+    }
+  }
+  qsort(dirty, n, sizeof(int), compare_slots_by_block);
+  for (i=0; i < n; i++) {
+    bufs[i]=slot_data(dirty[i]);
+    blocknums[i]=bc.slots[dirty[i]].blocknum;
+  }
+  if (n > 0 && ! writev_sd_blocks(bufs, blocknums, n)) {
+    ret=0;
+  }
+  else {
+    for (i=0; i < n; i++) {
+      bc.slots[dirty[i]].dirty=0;
+    }
+    bc.stats.writebacks += n;
+  }
+  free(dirty);
+  free(bufs);
+  free(blocknums);
+  return ret;
+}
+
+// copies the current cache counters into 'stats'.
+void get_block_cache_stats(BlockCacheStats *stats) {
+  pthread_mutex_lock(&cache_lock);
+  *stats=bc.stats;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+// zeroes the cache counters.
+void reset_block_cache_stats(void) {
+  pthread_mutex_lock(&cache_lock);
+  bzero(&bc.stats, sizeof(bc.stats));
+  pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,103 @@
+//
+// Write-back block buffer cache layered between the filesystem and the
+// software disk.  Blocks are kept in LRU order; dirty blocks are written to
+// the software disk when evicted, on flush_block_cache(), and at exit.  Every
+// function may be called from several threads at once.
+//
+
+#define BLOCK_CACHE_DEFAULT_BLOCKS 256
+
+// cache counters, see get_block_cache_stats()
+typedef struct BlockCacheStats {
+  unsigned long hits;          // reads and writes satisfied by a cached block
+  unsigned long misses;        // reads that had to go to the software disk
+  unsigned long writebacks;    // dirty blocks written to the software disk
+  unsigned long evictions;     // blocks dropped to make room for another
+} BlockCacheStats;
+
+// one run of consecutive blocks for read_cache_runs() and write_cache_runs()
+typedef struct CacheRun {
+  void *buf;                   // count * SOFTWARE_DISK_BLOCK_SIZE bytes
+  unsigned long blocknum;
+  unsigned long count;
+} CacheRun;
+
+// function prototypes for block cache API
+
+// (re)sizes the cache to hold 'numblocks' blocks, flushing and dropping
+// anything currently cached.  The cache initializes itself with
+// BLOCK_CACHE_DEFAULT_BLOCKS on first use if this is never called.  Returns 1
+// on success or 0 on failure, which includes a block still being pinned.
+int init_block_cache(unsigned long numblocks);
+
+// reads block 'blocknum' into 'buf', from the cache if present, otherwise from
+// the software disk.  'buf' must be of size SOFTWARE_DISK_BLOCK_SIZE.  Returns
+// 1 on success or 0 on failure.  On failure 'sderror' describes the problem.
+int read_cache_block(void *buf, unsigned long blocknum);
+
+// copies 'buf' into the cached copy of block 'blocknum' and marks it dirty.
+// The software disk is not written until the block is evicted or flushed.
+// Returns 1 on success or 0 on failure.  On failure 'sderror' describes the
+// problem.
+int write_cache_block(void *buf, unsigned long blocknum);
+
+// reads 'count' consecutive blocks starting at 'blocknum' into 'buf', which
+// must be of size count * SOFTWARE_DISK_BLOCK_SIZE.  Cached blocks are copied
+// from the cache and runs of uncached blocks are read from the software disk
+// in one request each, without being added to the cache.  A single block is
+// handled like read_cache_block().  Returns 1 on success or 0 on failure.
+int read_cache_blocks(void *buf, unsigned long blocknum, unsigned long count);
+
+// writes 'count' consecutive blocks from 'buf' starting at 'blocknum' directly
+// to the software disk in one request, refreshing any cached copies.  A single
+// block is handled like write_cache_block().  Returns 1 on success or 0 on
+// failure.
+int write_cache_blocks(void *buf, unsigned long blocknum, unsigned long count);
+
+// reads each of the 'numruns' runs in 'runs', like read_cache_blocks(), with
+// every software disk request for all of them submitted together and waited
+// for once.  Returns 1 on success or 0 on failure.
+int read_cache_runs(CacheRun *runs, unsigned long numruns);
+
+// writes each of the 'numruns' runs in 'runs', like write_cache_blocks(), with
+// the software disk requests for all of them submitted together and waited for
+// once.  Returns 1 on success or 0 on failure.
+int write_cache_runs(CacheRun *runs, unsigned long numruns);
+
+// writes 'count' consecutive blocks from 'buf' starting at 'blocknum' straight
+// to the software disk, even a single block, refreshing any cached copies, and
+// syncs the software disk, so they are durable when it returns.  Other dirty
+// blocks stay in the cache.  Returns 1 on success or 0 on failure.
+int write_cache_blocks_sync(void *buf, unsigned long blocknum, unsigned long count);
+
+// pins block 'blocknum' in the cache, reading it in from the software disk if
+// it isn't cached, and returns a read-only pointer to the cached copy, or NULL
+// on failure.  A pinned block stays cached until every pin is released with
+// unpin_cache_block(); writes to it change the copy in place.  The cache
+// can't be resized while any block is pinned.
+const void *pin_cache_block(unsigned long blocknum);
+
+// releases one pin_cache_block() of block 'blocknum'.
+void unpin_cache_block(unsigned long blocknum);
+
+// reads those of the 'count' consecutive blocks starting at 'blocknum' that
+// aren't cached into the cache, in one software disk request, so that reading
+// or pinning them later doesn't go to the software disk.  At most half the
+// cache is used.  Returns 1 on success or 0 on failure.
+int prefetch_cache_blocks(unsigned long blocknum, unsigned long count);
+
+// writes every dirty block back to the software disk in block order and syncs
+// the software disk.  Returns 1 on success or 0 on failure.
+int flush_block_cache(void);
+
+// writes every dirty block back to the software disk in block order like
+// flush_block_cache(), but doesn't sync the software disk, so the blocks are
+// durable only after the next sync, such as write_cache_blocks_sync() makes.
+// Returns 1 on success or 0 on failure.
+int write_back_block_cache(void);
+
+// copies the current cache counters into 'stats'.
+void get_block_cache_stats(BlockCacheStats *stats);
+
+// zeroes the cache counters.
+void reset_block_cache_stats(void);
@@ -3,560 +3,3171 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <limits.h>
+#include <pthread.h>
+#include <time.h>
 #include "filesystem.h"
 #include "softwaredisk.h"
-
-#define MAX_NAME_SIZE 128
-#define NUM_DIRECTLY_MAPPED_INODE_BLOCKS 9 //How many data blocks each inode maps to
-#define NUM_INDIRECT_BLOCK_MAPPINGS 256 //512 divided by 2
-#define INODES_PER_INODE_BLOCK 24
-
-#define INODE_BITMAP_INDEX 0
-#define DATA_BITMAP_INDEX 1
-
-#define FIRST_INODE_BLOCK_INDEX 2
-#define LAST_INODE_BLOCK_INDEX 57//An Inode takes up 28 bytes of space, so each Inode block holds 18 Inodes.
-                                     //And since we want to support up to 1008 files, we need 1008/18=56 Inode blocks
-#define FIRST_DIRECTORY_ITEM_BLOCK_INDEX 58 //We want to support up to 1008 files, so we need 1008
-                                                //directory item blocks
-#define LAST_DIRECTORY_ITEM_BLOCK_INDEX 1108
-
-
-#define MAX_FILE_BYTES SOFTWARE_DISK_BLOCK_SIZE * NUM_DIRECTLY_MAPPED_INODE_BLOCKS + NUM_INDIRECT_BLOCK_MAPPINGS * SOFTWARE_DISK_BLOCK_SIZE
-
-#define FIRST_DATA_BLOCK_INDEX 1109
-#define LAST_DATA_BLOCK_INDEX 4999
-
-FSError fserror;
+#include "blockcache.h"
+
+#define FILESYSTEM_MAGIC 0x53465342 //"BSFS" in little endian
+#define FILESYSTEM_VERSION 2
+#define SUPERBLOCK_INDEX 0 //Everything else on the disk is found through the superblock
+#define JOURNAL_MAGIC 0x4c4e524a //"JRNL" in little endian
+
+#define MAX_NAME_SIZE (FS_MAX_NAME_LENGTH + 1) //Keeps a directory item at 128 bytes, so four fit in a block
+#define NUM_DIRECTLY_MAPPED_INODE_BLOCKS 12 //How many data blocks each inode maps to
+#define INDIRECT_BLOCK_SLOT NUM_DIRECTLY_MAPPED_INODE_BLOCKS //Where the inode keeps its indirect block
+#define DOUBLE_INDIRECT_BLOCK_SLOT (NUM_DIRECTLY_MAPPED_INODE_BLOCKS + 1) //Where the inode keeps its double indirect block
+#define NUM_INDIRECT_BLOCK_MAPPINGS (SOFTWARE_DISK_BLOCK_SIZE / sizeof(uint32_t)) //512 divided by 4
+#define NUM_MAP_BLOCKS (1 + NUM_INDIRECT_BLOCK_MAPPINGS) //The indirect block plus every block under the double indirect block
+#define INODES_PER_INODE_BLOCK (SOFTWARE_DISK_BLOCK_SIZE / sizeof(Inode))
+#define DIRECTORY_ITEMS_PER_BLOCK (SOFTWARE_DISK_BLOCK_SIZE / sizeof(DirectoryItem))
+
+#define MAX_FILE_BLOCKS (NUM_DIRECTLY_MAPPED_INODE_BLOCKS + NUM_MAP_BLOCKS * NUM_INDIRECT_BLOCK_MAPPINGS) //Most an inode can map
+#define MAX_FILE_BYTES ((unsigned long)MAX_FILE_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE)
+
+#define BITMAP_WORDS (SOFTWARE_DISK_BLOCK_SIZE / sizeof(uint64_t))
+#define BITS_PER_BITMAP_BLOCK (SOFTWARE_DISK_BLOCK_SIZE * 8)
+#define FORMAT_CHUNK_BLOCKS 64 //How many blocks fs_format zeroes with each request
+#define DELAYED_ALLOCATION_BLOCKS 128 //Most new data an open file holds in memory before it gets disk blocks
+#define MIN_READAHEAD_BLOCKS 4 //Blocks read past the first read that carries on from the last
+#define MAX_READAHEAD_BLOCKS 64 //Most blocks read past a read, reached by doubling while reads stay sequential
+#define UNWRITTEN_BLOCK 0x80000000u //Set in a block mapping preallocated by preallocate_file and never written, which reads as zeros
+#define INODE_INLINE_DATA 1 //Inode flag: the file's data is kept in the inode's blocks array instead of in data blocks
+#define MAX_INLINE_BYTES (sizeof(uint32_t) * (NUM_DIRECTLY_MAPPED_INODE_BLOCKS + 2)) //Room in the blocks array
+
+#define JOURNAL_HEADER_RECORD 1 //First block of the journal, names the first transaction to replay
+#define JOURNAL_DESCRIPTOR_RECORD 2 //Lists the home blocks of the copies that follow it
+#define JOURNAL_COMMIT_RECORD 3 //Ends a transaction with a checksum of its descriptors and copies
+#define JOURNAL_BLOCKS_PER_DESCRIPTOR ((SOFTWARE_DISK_BLOCK_SIZE - 5 * sizeof(uint32_t)) / sizeof(uint32_t))
+#define CHECKSUM_SEED 2166136261u
+#define BATCH_CHUNK_FILES 256 //Most files create_files or delete_files handles in one transaction
+
+__thread FSError fserror;
+
+//Describes the layout of the disk. fs_format writes it to block 0 and the filesystem reads it back the first
+//time it is used. Regions are given as a first block and a number of blocks.
+typedef struct Superblock {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t maxFileSize; //Largest file allowed, in bytes, no more than MAX_FILE_BYTES
+    uint32_t numBlocks;
+    uint32_t numInodes;
+    uint32_t numDirectoryItems;
+    uint32_t journalStart;
+    uint32_t numJournalBlocks;
+    uint32_t inodeBitmapStart;
+    uint32_t numInodeBitmapBlocks;
+    uint32_t dataBitmapStart;
+    uint32_t numDataBitmapBlocks;
+    uint32_t inodeTableStart;
+    uint32_t numInodeTableBlocks;
+    uint32_t directoryStart;
+    uint32_t numDirectoryBlocks;
+    uint32_t dataStart;
+    uint32_t numDataBlocks;
+} Superblock;
+
+typedef struct SuperblockBlock {
+    Superblock superblock;
+    unsigned char unused[SOFTWARE_DISK_BLOCK_SIZE - sizeof(Superblock)];
+} SuperblockBlock;
 
 typedef struct DirectoryItem {
-    unsigned short int inodeIndex;
+    uint32_t inodeIndex;
+    unsigned char allocated;
+    unsigned char open; //Set in a handle's copy while the handle is open. Which files are open is only kept in
+                        //memory, so on disk it is always written as 0.
     char name[MAX_NAME_SIZE];
-    int allocated;
-    int open;
 } DirectoryItem;
 
 typedef struct Inode {
-    unsigned long int fileSize; //Size of the file this Inode maps to in bytes
-    unsigned short int blocks[NUM_DIRECTLY_MAPPED_INODE_BLOCKS + 1]; //The Inode has a number of
-                                        //directly mapped data blocks defined by the constant + 1 for the
-                                        //indirect block.
+    uint32_t fileSize; //Size of the file this Inode maps to in bytes. Files are smaller than 4 GB, so this used to
+                       //be the low half of a 64 bit size whose high half, now flags, was always 0.
+    uint32_t flags;
+    uint32_t blocks[NUM_DIRECTLY_MAPPED_INODE_BLOCKS + 2]; //The Inode has a number of directly mapped data
+                                        //blocks defined by the constant, then the indirect block and the
+                                        //double indirect block. With INODE_INLINE_DATA set it holds the
+                                        //data of the file instead, zeros past the end.
 } Inode;
 
+typedef struct IndirectBlock {
+    uint32_t blocks[NUM_INDIRECT_BLOCK_MAPPINGS];
+} IndirectBlock;
+
 typedef struct FileInternals {
     DirectoryItem directory;
-    unsigned short int directoryItemBlockIndex;
+    unsigned int directorySlot; //Index of the file's directory item across the whole directory
+    uint32_t generation; //Told apart from earlier opens of the same slot, for handles
     Inode inode;
     unsigned long int position;
     FileMode fileMode;
+    pthread_mutex_t lock; //Held by every operation on the file, so different files proceed in parallel
+    IndirectBlock *mapBlocks; //Resident copies of the file's NUM_MAP_BLOCKS indirect blocks, read the first time
+                              //a block past the direct blocks is needed. 0 is the indirect block and 1 + i the
+                              //i-th block the double indirect block points to.
+    IndirectBlock doubleIndirectBlock; //Loaded along with mapBlocks
+    unsigned char mapBlockDirty[NUM_MAP_BLOCKS]; //Written back on close rather than on every allocation
+    int doubleIndirectBlockDirty;
+    int inodeDirty; //The inode changed since it was last written
+    int blocksMapped; //Blocks were given disk blocks since the file was last written back
+    unsigned char *delayedBlocks; //New data for blocks without a disk block yet, room for DELAYED_ALLOCATION_BLOCKS
+    unsigned int delayedStart; //Block of the file the first delayed block belongs to
+    unsigned int numDelayedBlocks; //Consecutive blocks of the file held in delayedBlocks
+    unsigned int numReservedBlocks; //Data blocks set aside so the delayed blocks are sure to fit
+    unsigned int numAllocatingBlocks; //Set-aside data blocks the file's allocations are taking theirs from
+    unsigned char *readAheadBlocks; //Blocks read past the end of the last read, room for MAX_READAHEAD_BLOCKS
+    unsigned int readAheadStart; //Block of the file the first read-ahead block belongs to
+    unsigned int numReadAheadBlocks;
+    unsigned int readAheadWindow; //How many blocks the next sequential read reads ahead, 0 after a random read
+    unsigned long nextReadPosition; //Where a read that carries on from the last one starts
+    unsigned int prefetchEnd; //Block of the file up to which views have prefetched blocks into the block cache
+    struct FileInternals *nextOpenFile;
 } FileInternals;
 
 typedef struct InodeBlock {
     Inode inodes[SOFTWARE_DISK_BLOCK_SIZE / sizeof(Inode)];
 } InodeBlock;
 
-typedef struct IndirectBlock {
-    unsigned short int blocks[NUM_INDIRECT_BLOCK_MAPPINGS];
-} IndirectBlock;
-
+//The inode table, read into memory when the filesystem is mounted. Inodes are read and changed here, and the blocks
+//that changed are listed so they can be written back through the journal together.
+typedef struct InodeTable {
+    InodeBlock *blocks;
+    unsigned char *dirtyBlocks; //One flag per inode block, set when the block changed since it was last written
+    unsigned int *dirtyList; //The blocks with their flag set, in the order they changed
+    unsigned int numDirty;
+    pthread_mutex_t lock; //Guards everything above
+} InodeTable;
+
+//An allocation bitmap kept in memory once it has been read. Bit i (bit i % 64 of word i / 64) is set when
+//inode or data block i is in use. A bit cleared by an operation whose transaction hasn't committed yet is also set
+//in pendingWords, and isn't handed out again until the commit, since the old owner may point at it until then.
 typedef struct Bitmap {
-    unsigned char bytes[SOFTWARE_DISK_BLOCK_SIZE];
+    uint64_t *words;
+    uint64_t *pendingWords;
+    uint32_t diskBlockIndex;
+    uint32_t numDiskBlocks;
+    unsigned int numBits; //Bits past this don't correspond to anything and are never handed out
+    unsigned int nextFreeWord; //Where the next search starts, so allocations rotate through the bitmap
+    unsigned int numFree; //Clear bits not set aside for delayed allocation or pending a commit
+    unsigned int numPending; //Bits set in pendingWords
+    int loaded;
+    unsigned char *dirtyBlocks; //One flag per disk block, set when the block changed since it was last written
+    pthread_mutex_t lock; //Guards everything above
 } Bitmap;
 
-//Sets an inode's status to either not-in-use or in-use. This is done by associating each bit
-//within the bitmap with the index of each inode.
-int setInodeStatus(unsigned short int inodeIndex, int status) {
-    Bitmap bitmap;
-    if (!read_sd_block(&bitmap, INODE_BITMAP_INDEX)) {
-        return 0;
-    }
-    else {
-        if (status)
-            bitmap.bytes[inodeIndex / 8] |= (1 << (7 - (inodeIndex % 8)));
-        else 
-            bitmap.bytes[inodeIndex / 8] &= -(1 << (7 - (inodeIndex % 8)));
-        if (!write_sd_block(&bitmap, INODE_BITMAP_INDEX)) {
-            return 0;
-        }
-    }
-
-    return 1;
+typedef struct DirectoryBlock {
+    DirectoryItem items[DIRECTORY_ITEMS_PER_BLOCK];
+} DirectoryBlock;
+
+//In-memory index of the directory, built from the directory blocks the first time the directory is used.
+//Each allocated slot is chained into a hash bucket by name, and unallocated slots are kept on a stack.
+typedef struct DirectoryIndex {
+    int loaded;
+    unsigned int numBuckets; //Power of two, at least twice the number of directory slots
+    int *buckets; //First slot of each chain, -1 if empty
+    int *next; //Next slot in the same chain
+    uint32_t *nameHashes;
+    unsigned int *freeSlots; //Lowest free slot on top
+    int numFreeSlots;
+    uint32_t *openSlots; //Generation of the handle that has the file in the slot open, 0 if none. Only set under the
+                         //directory lock, and set and cleared atomically, since closing a file doesn't take the lock.
+    File *openSlotFiles; //The open file in each slot whose openSlots entry is set
+} DirectoryIndex;
+
+//One block of journal bookkeeping. The journal starts with a header record, followed by transactions written one
+//after another: a descriptor record, the copies of the blocks it lists, maybe more descriptors and copies, then a
+//commit record.
+typedef struct JournalRecord {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t sequence; //Of the transaction, or in the header of the first one to replay
+    uint32_t count; //Blocks listed by a descriptor, or in the whole transaction for a commit record
+    uint32_t checksum; //Commit records only
+    uint32_t blockIndexes[JOURNAL_BLOCKS_PER_DESCRIPTOR];
+} JournalRecord;
+
+//Metadata blocks changed by one or more operations, held in memory until the transaction is committed. Copies are
+//found by block index through an open addressing hash.
+typedef struct JournalTransaction {
+    unsigned int numBlocks;
+    uint32_t *blockIndexes;
+    unsigned char *blocks; //Copy i starts at i * SOFTWARE_DISK_BLOCK_SIZE
+    int *hashSlots; //Index into blockIndexes, -1 if empty
+    uint32_t *freedBlocks; //Data region blocks freed by the transaction, pending in the data bitmap until it commits
+    unsigned int numFreedBlocks;
+    unsigned int maxFreedBlocks;
+    int freesMetadata; //One of freedBlocks was an indirect block
+} JournalTransaction;
+
+//Metadata changes go through the journal. Operations add the blocks they change to the running transaction, which
+//is committed in one sequential write when it fills up or the filesystem is flushed, along with whatever other
+//operations changed in the meantime. Committed blocks go to the block cache and reach their home on disk whenever
+//the cache writes them back.
+typedef struct Journal {
+    int loaded;
+    JournalTransaction transactions[2];
+    JournalTransaction *running;
+    JournalTransaction *committing; //NULL unless a commit is writing it out
+    unsigned int maxTransactionBlocks;
+    unsigned int numHashSlots; //Power of two, at least twice maxTransactionBlocks
+    unsigned int numHandles; //Operations adding to the running transaction
+    unsigned int reservedBlocks; //Blocks those operations said they might add
+    unsigned int commitsWaiting; //New operations wait while a commit waits for the running ones to finish
+    int aborted; //A commit failed, so nothing more is written
+    uint32_t sequence; //Of the running transaction
+    uint32_t nextRecord; //Where the next transaction goes, counted from the start of the journal
+    int restartPending; //The last commit freed an indirect block, so the next one starts the journal over
+    pthread_mutex_t lock; //Guards everything above
+    pthread_cond_t changed;
+} Journal;
+
+//Counters one thread keeps for fs_get_stats. Only the owning thread updates them, so counting takes no lock. When
+//the thread exits they go to the next new thread, which carries on from them, so nothing counted is lost.
+typedef struct ThreadStats {
+    FSStats stats;
+    int inUse;
+    struct ThreadStats *next;
+} ThreadStats;
+
+//When a public function was called and how many blocks its thread had moved by then
+typedef struct OperationTimer {
+    struct timespec start;
+    unsigned long blocksRead;
+    unsigned long blocksWritten;
+} OperationTimer;
+
+static Superblock superblock;
+static int mounted; //Read without mountLock once set
+static pthread_mutex_t mountLock = PTHREAD_MUTEX_INITIALIZER;
+
+static Bitmap inodeBitmap = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static Bitmap dataBitmap = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static InodeTable inodeTable = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+//Lookups and opening a file share the directory lock, and changes to the directory take it exclusively.
+static DirectoryIndex directoryIndex;
+static pthread_rwlock_t directoryLock = PTHREAD_RWLOCK_INITIALIZER;
+
+static Journal journal = { .lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER };
+
+static const unsigned char zeroBlock[SOFTWARE_DISK_BLOCK_SIZE]; //What views of blocks without data point to
+
+static File openFiles; //Every open file, linked through nextOpenFile
+static uint32_t lastGeneration; //Of the last file opened, over every mount
+static pthread_mutex_t openFilesLock = PTHREAD_MUTEX_INITIALIZER; //Never taken with a transaction handle open
+
+static __thread ThreadStats *threadStats;
+static __thread unsigned long threadBlocksRead, threadBlocksWritten; //Blocks the thread moved through the cache
+static ThreadStats *allThreadStats; //Linked through next
+static FSStats statsBaseline; //Every thread's counters added up when fs_reset_stats was last called
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER; //Guards allThreadStats, inUse and statsBaseline
+static pthread_key_t statsKey; //Gives a thread's counters back when it exits
+static pthread_once_t statsKeyOnce = PTHREAD_ONCE_INIT;
+
+static const char *operationNames[FS_NUM_OPERATIONS] = { "create_file", "open_file", "close_file", "read_file",
+    "view_file", "write_file", "seek_file", "preallocate_file", "delete_file", "file_exists", "file_region",
+    "create_files", "delete_files" };
+static const char *pathNames[FS_NUM_PATHS] = { "bitmap scan", "directory scan", "indirect lookup" };
+
+static void flushAtExit(void);
+int loadDirectoryIndex(void);
+
+//Adds n to one of the calling thread's counters. Only the owner writes it, so a plain load and store do, made
+//atomic only so fs_get_stats can read the counter at the same time.
+void addCount(unsigned long *counter, unsigned long n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
 }
 
-//Sets a file data block to either not-in-use or in-use. This is done by associating each
-//bit within the bitmap with the index of each data block.
-int setDataBlockStatus(unsigned short int blockIndex, int status) {
-    Bitmap bitmap;
-    if (!read_sd_block(&bitmap, DATA_BITMAP_INDEX)) {
-        return 0;
-    }
-    else {
-        if (status)
-            bitmap.bytes[blockIndex / 8] |= (1 << (7 - (blockIndex % 8)));
-        else 
-            bitmap.bytes[blockIndex / 8] &= -(1 << (7 - (blockIndex % 8)));
-        if (!write_sd_block(&bitmap, DATA_BITMAP_INDEX)) {
-            return 0;
-        }
-    }
-
-    return 1;
+//Runs when a thread that counted something exits.
+void releaseThreadStats(void *stats) {
+    pthread_mutex_lock(&statsLock);
+    ((ThreadStats *)stats)->inUse = 0;
+    pthread_mutex_unlock(&statsLock);
 }
 
-//Writes an inode to the specified inodeIndex.
-int writeInode(unsigned short int inodeIndex, Inode inode) {
-    InodeBlock inodeBlock;
+void createStatsKey(void) {
+    pthread_key_create(&statsKey, releaseThreadStats);
+}
 
-    unsigned short int inodeBlockIndex = inodeIndex / INODES_PER_INODE_BLOCK + FIRST_INODE_BLOCK_INDEX;
-    if (inodeBlockIndex <= LAST_INODE_BLOCK_INDEX) {
-        if (!read_sd_block(&inodeBlock, inodeBlockIndex)) {
-            return 0;
-        }
-        else {
-            inodeBlock.inodes[inodeIndex % INODES_PER_INODE_BLOCK] = inode;
-            if (!write_sd_block(&inodeBlock, inodeBlockIndex)) {
-                fserror = FS_IO_ERROR;
-                return 0;
-            }
+//Finds the calling thread's counters, taking over those of an exited thread or adding new ones the first time.
+//Returns NULL if there's no memory for them, and then nothing is counted.
+FSStats *getThreadStats(void) {
+    ThreadStats *stats = threadStats;
+
+    if (stats)
+        return &stats->stats;
+    pthread_once(&statsKeyOnce, createStatsKey);
+    pthread_mutex_lock(&statsLock);
+    for (stats = allThreadStats; stats && stats->inUse; stats = stats->next)
+        ;
+    if (!stats) {
+        stats = calloc(1, sizeof(ThreadStats));
+        if (stats) {
+            stats->next = allThreadStats;
+            allThreadStats = stats;
         }
     }
-    return 1;
+    if (stats)
+        stats->inUse = 1;
+    pthread_mutex_unlock(&statsLock);
+    if (!stats)
+        return NULL;
+    threadStats = stats;
+    pthread_setspecific(statsKey, stats);
+    return &stats->stats;
 }
 
-//Finds the index of the irst available data block by checking each bit of the data block bitmap, looking
-//for the first 0.
-int findFreeDataBlockIndex(void) {
-    Bitmap bitmap;
+//Counts calls along an internal path and the steps they took.
+void countPath(FSPath path, unsigned long calls, unsigned long steps) {
+    FSStats *stats = getThreadStats();
 
-    if (!read_sd_block(&bitmap, DATA_BITMAP_INDEX)) {
-        fserror=FS_IO_ERROR;
-        return -1;
-    }
-    else {
-        int byte, bit;
-        for (byte = 0; byte < SOFTWARE_DISK_BLOCK_SIZE; byte++) {
-            for (bit = 0; bit < 8; bit++) {
-                if ((bitmap.bytes[byte] & (1 << (7 - bit))) == 0) {
-                    return byte*8 + bit;
-                }
-            }
-        }
+    if (stats) {
+        addCount(&stats->paths[path].calls, calls);
+        addCount(&stats->paths[path].steps, steps);
     }
+}
 
-    return -1;
+//Notes when a public function was called, and tags the software disk requests it makes in block I/O traces.
+void startOperation(OperationTimer *timer, FSOperation operation) {
+    set_sd_trace_caller(operation + 1);
+    timer->blocksRead = threadBlocksRead;
+    timer->blocksWritten = threadBlocksWritten;
+    clock_gettime(CLOCK_MONOTONIC, &timer->start);
 }
 
+//Counts a finished call of a public function that moved the given number of bytes, with how long it took, the
+//blocks it moved and whether it left an error in fserror.
+void endOperation(OperationTimer *timer, FSOperation operation, unsigned long bytes) {
+    FSStats *stats = getThreadStats();
+    FSOperationStats *operationStats;
+    struct timespec end;
+    unsigned long nanoseconds;
+    int bucket;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    set_sd_trace_caller(0);
+    if (!stats)
+        return;
+    operationStats = &stats->operations[operation];
+    nanoseconds = (unsigned long)((end.tv_sec - timer->start.tv_sec) * 1000000000L + end.tv_nsec - timer->start.tv_nsec);
+    bucket = nanoseconds ? 63 - __builtin_clzl(nanoseconds) : 0;
+    if (bucket >= FS_LATENCY_BUCKETS)
+        bucket = FS_LATENCY_BUCKETS - 1;
+    addCount(&operationStats->calls, 1);
+    addCount(&operationStats->errors, fserror != FS_NONE);
+    addCount(&operationStats->bytes, bytes);
+    addCount(&operationStats->blocks_read, threadBlocksRead - timer->blocksRead);
+    addCount(&operationStats->blocks_written, threadBlocksWritten - timer->blocksWritten);
+    addCount(&operationStats->nanoseconds, nanoseconds);
+    addCount(&operationStats->latency[bucket], 1);
+}
 
-//Sets one of the inode's blocks to the given block index.
-int setInodeDataBlock(unsigned short int blockIndex, unsigned short int overwriteBlockIndex, File file) {
-    int newIndirectBlockIndex;
-    IndirectBlock * indirectBlock;
+//Adds up every thread's counters into total. FSStats holds nothing but unsigned longs, so it is added up as an
+//array of them. The caller holds statsLock.
+void sumThreadStats(FSStats *total) {
+    unsigned long *sum = (unsigned long *)total, *counters;
 
-    if (blockIndex < NUM_DIRECTLY_MAPPED_INODE_BLOCKS)
-        file->inode.blocks[blockIndex] = overwriteBlockIndex;
-    else {
-        //Creates an indirect block if one doesn't exist within the iNode yet
-        if (!file->inode.blocks[NUM_DIRECTLY_MAPPED_INODE_BLOCKS]) {
-            newIndirectBlockIndex = findFreeDataBlockIndex();
-            indirectBlock = (IndirectBlock*)malloc(sizeof(IndirectBlock));
-            bzero(indirectBlock, sizeof(IndirectBlock));
+    bzero(total, sizeof(FSStats));
+    for (ThreadStats *stats = allThreadStats; stats; stats = stats->next) {
+        counters = (unsigned long *)&stats->stats;
+        for (unsigned long i = 0; i < sizeof(FSStats) / sizeof(unsigned long); i++)
+            sum[i] += __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+    }
+}
 
-            if (!setDataBlockStatus(newIndirectBlockIndex, 1)) {
-                return 0;
-            }
+//How many journal blocks a transaction of numBlocks blocks takes up, with its descriptors and commit record.
+unsigned long journalRecordBlocks(unsigned long numBlocks) {
+    return numBlocks + (numBlocks + JOURNAL_BLOCKS_PER_DESCRIPTOR - 1) / JOURNAL_BLOCKS_PER_DESCRIPTOR + 1;
+}
 
-            file->inode.blocks[NUM_DIRECTLY_MAPPED_INODE_BLOCKS] = newIndirectBlockIndex;
-        }
+//Most metadata blocks a single operation changes: the indirect blocks of a file, its inode, its directory block
+//and every bitmap block.
+unsigned long maxOperationBlocks(unsigned long numInodeBitmapBlocks, unsigned long numDataBitmapBlocks) {
+    return NUM_MAP_BLOCKS + 1 + 2 + numInodeBitmapBlocks + numDataBitmapBlocks;
+}
 
-        else {
-            if (!read_sd_block(indirectBlock, file->inode.blocks[NUM_DIRECTLY_MAPPED_INODE_BLOCKS]))
-                return 0;
-        }
-        if (!setDataBlockStatus(overwriteBlockIndex, 1))
-            return 0;
+//Lays out a disk of numBlocks blocks with room for the given number of inodes and directory items: the
+//superblock, the journal, the inode bitmap, the data bitmap, the inode table, the directory and then the data
+//region. The journal holds two of the largest transactions a single operation needs. Returns 0 if they don't fit
+//or the largest file size is more than an inode can map.
+int computeLayout(Superblock *layout, unsigned long numBlocks, unsigned long numInodes, unsigned long numDirectoryItems,
+                  unsigned long maxFileSize) {
+    unsigned long numInodeBitmapBlocks, numInodeTableBlocks, numDirectoryBlocks, metadataBlocks, numDataBitmapBlocks;
+    unsigned long numJournalBlocks;
+
+    if (numBlocks > INT_MAX || numInodes == 0 || numInodes > INT_MAX || numDirectoryItems == 0 || numDirectoryItems > INT_MAX
+            || maxFileSize == 0 || maxFileSize > MAX_FILE_BYTES)
+        return 0;
+    numInodeBitmapBlocks = (numInodes + BITS_PER_BITMAP_BLOCK - 1) / BITS_PER_BITMAP_BLOCK;
+    numInodeTableBlocks = (numInodes + INODES_PER_INODE_BLOCK - 1) / INODES_PER_INODE_BLOCK;
+    numDirectoryBlocks = (numDirectoryItems + DIRECTORY_ITEMS_PER_BLOCK - 1) / DIRECTORY_ITEMS_PER_BLOCK;
+    //Sized for a data bitmap covering the whole disk, which is never smaller than the one it gets
+    numJournalBlocks = 1 + 2 * journalRecordBlocks(maxOperationBlocks(numInodeBitmapBlocks,
+                                                                      (numBlocks + BITS_PER_BITMAP_BLOCK - 1) / BITS_PER_BITMAP_BLOCK));
+    metadataBlocks = SUPERBLOCK_INDEX + 1 + numJournalBlocks + numInodeBitmapBlocks + numInodeTableBlocks + numDirectoryBlocks;
+    if (metadataBlocks >= numBlocks)
+        return 0;
+    //Each data bitmap block takes up a block of its own as well as covering BITS_PER_BITMAP_BLOCK data blocks
+    numDataBitmapBlocks = (numBlocks - metadataBlocks + BITS_PER_BITMAP_BLOCK) / (BITS_PER_BITMAP_BLOCK + 1);
+    if (metadataBlocks + numDataBitmapBlocks >= numBlocks)
+        return 0;
 
-        indirectBlock->blocks[blockIndex - NUM_DIRECTLY_MAPPED_INODE_BLOCKS] = overwriteBlockIndex;
-        if (!write_sd_block(indirectBlock, file->inode.blocks[NUM_DIRECTLY_MAPPED_INODE_BLOCKS]))
-            return 0;
+    bzero(layout, sizeof(Superblock));
+    layout->magic = FILESYSTEM_MAGIC;
+    layout->version = FILESYSTEM_VERSION;
+    layout->maxFileSize = maxFileSize;
+    layout->numBlocks = numBlocks;
+    layout->numInodes = numInodes;
+    layout->numDirectoryItems = numDirectoryItems;
+    layout->journalStart = SUPERBLOCK_INDEX + 1;
+    layout->numJournalBlocks = numJournalBlocks;
+    layout->inodeBitmapStart = layout->journalStart + numJournalBlocks;
+    layout->numInodeBitmapBlocks = numInodeBitmapBlocks;
+    layout->dataBitmapStart = layout->inodeBitmapStart + numInodeBitmapBlocks;
+    layout->numDataBitmapBlocks = numDataBitmapBlocks;
+    layout->inodeTableStart = layout->dataBitmapStart + numDataBitmapBlocks;
+    layout->numInodeTableBlocks = numInodeTableBlocks;
+    layout->directoryStart = layout->inodeTableStart + numInodeTableBlocks;
+    layout->numDirectoryBlocks = numDirectoryBlocks;
+    layout->dataStart = layout->directoryStart + numDirectoryBlocks;
+    layout->numDataBlocks = numBlocks - layout->dataStart;
+    return 1;
+}
 
-        if (!writeInode(file->directory.inodeIndex, file->inode))
-            return 0;
-    }
+//Points a bitmap at its blocks on disk. It is read the first time it's used.
+void resetBitmap(Bitmap *bitmap, uint32_t diskBlockIndex, uint32_t numDiskBlocks, unsigned int numBits) {
+    pthread_mutex_lock(&bitmap->lock);
+    free(bitmap->words);
+    free(bitmap->pendingWords);
+    free(bitmap->dirtyBlocks);
+    bitmap->words = NULL;
+    bitmap->pendingWords = NULL;
+    bitmap->dirtyBlocks = NULL;
+    bitmap->diskBlockIndex = diskBlockIndex;
+    bitmap->numDiskBlocks = numDiskBlocks;
+    bitmap->numBits = numBits;
+    bitmap->nextFreeWord = 0;
+    bitmap->loaded = 0;
+    pthread_mutex_unlock(&bitmap->lock);
+}
 
-    return 1;
+//Checksums blocks of the journal (FNV-1a), carrying on from checksum.
+uint32_t checksumBlocks(uint32_t checksum, void *data, unsigned long numBlocks) {
+    unsigned char *bytes = data;
+    for (unsigned long i = 0; i < numBlocks * SOFTWARE_DISK_BLOCK_SIZE; i++) {
+        checksum ^= bytes[i];
+        checksum *= 16777619u;
+    }
+    return checksum;
 }
 
+//Empties a transaction.
+void clearTransaction(JournalTransaction *transaction) {
+    transaction->numBlocks = 0;
+    transaction->numFreedBlocks = 0;
+    transaction->freesMetadata = 0;
+    for (unsigned int i = 0; i < journal.numHashSlots; i++)
+        transaction->hashSlots[i] = -1;
+}
 
+//Finds the hash slot for a block of a transaction: the one holding it, or the empty one it would go in.
+unsigned int findTransactionSlot(JournalTransaction *transaction, uint32_t blockIndex) {
+    unsigned int slot = (blockIndex * 2654435761u) & (journal.numHashSlots - 1);
+    while (transaction->hashSlots[slot] != -1 && transaction->blockIndexes[transaction->hashSlots[slot]] != blockIndex)
+        slot = (slot + 1) & (journal.numHashSlots - 1);
+    return slot;
+}
 
-//Finds the index of the first available inode by checking each bit of the inode bitmap, looking for the first 0.
-unsigned short int findFreeInodeIndex(void) {
-    Bitmap bitmap;
+//Finds the copy of a block in a transaction, or returns NULL if the transaction doesn't have it.
+unsigned char *findTransactionBlock(JournalTransaction *transaction, uint32_t blockIndex) {
+    int index = transaction->hashSlots[findTransactionSlot(transaction, blockIndex)];
+    if (index == -1)
+        return NULL;
+    return transaction->blocks + (unsigned long)index * SOFTWARE_DISK_BLOCK_SIZE;
+}
 
-    if (!read_sd_block(&bitmap, INODE_BITMAP_INDEX)) {
-        fserror=FS_IO_ERROR;
-        return -1;
-    }
-    else {
-        int byte, bit;
-        for (byte = 0; byte < SOFTWARE_DISK_BLOCK_SIZE; byte++) {
-            for (bit = 0; bit < 8; bit++) {
-                if ((bitmap.bytes[byte] & (1 << (7 - bit))) == 0) {
-                    return byte*8 + bit;
-                }
-            }
-        }
+//Copies a block into a transaction, replacing the copy it already has. Returns 0 if the transaction is full.
+int addTransactionBlock(JournalTransaction *transaction, void *data, uint32_t blockIndex) {
+    unsigned int slot = findTransactionSlot(transaction, blockIndex);
+    if (transaction->hashSlots[slot] == -1) {
+        if (transaction->numBlocks == journal.maxTransactionBlocks)
+            return 0;
+        transaction->hashSlots[slot] = transaction->numBlocks;
+        transaction->blockIndexes[transaction->numBlocks++] = blockIndex;
     }
-
-    return -1;
+    memcpy(transaction->blocks + (unsigned long)transaction->hashSlots[slot] * SOFTWARE_DISK_BLOCK_SIZE, data,
+           SOFTWARE_DISK_BLOCK_SIZE);
+    return 1;
 }
 
-//Simply writes the given directory to the given directory block index.
-int writeDirectoryItem(DirectoryItem directory, unsigned short int blockIndex) {
-    if (write_sd_block(&directory, blockIndex))
-        return 1;
-    else
-        return 0;
+//Fills in a journal header, which has replay begin with the given transaction at the start of the journal.
+void fillJournalHeader(JournalRecord *record, uint32_t sequence) {
+    bzero(record, sizeof(JournalRecord));
+    record->magic = JOURNAL_MAGIC;
+    record->type = JOURNAL_HEADER_RECORD;
+    record->sequence = sequence;
 }
 
-//Creates a new directory item by searching for the first empty directory block and then writing to it.
-int createDirectoryItem(DirectoryItem directory) {
-    DirectoryItem * currentDirectory = (DirectoryItem*) malloc(sizeof(DirectoryItem));
-    for (unsigned short int i = FIRST_DIRECTORY_ITEM_BLOCK_INDEX; i <= LAST_DIRECTORY_ITEM_BLOCK_INDEX; i++) {
+//Writes the header of the journal starting at journalStart, so replay begins with the given transaction at the
+//start of the journal.
+int writeJournalHeader(uint32_t journalStart, uint32_t sequence) {
+    JournalRecord record;
 
-        if (!read_sd_block(currentDirectory, i)) {
-            fserror = FS_IO_ERROR;
-            break;
+    fillJournalHeader(&record, sequence);
+    return write_cache_blocks_sync(&record, journalStart, 1);
+}
+
+//Reads the next transaction from the journal at position into transaction, checking that it carries the expected
+//sequence number, that its blocks are inside the filesystem and that it was committed whole. Returns 1 and moves
+//position past it if so, 0 at the end of the journal or -1 if reading fails.
+int readJournalTransaction(JournalTransaction *transaction, uint32_t *position) {
+    JournalRecord record;
+    unsigned char copy[SOFTWARE_DISK_BLOCK_SIZE];
+    uint32_t checksum = CHECKSUM_SEED, next = *position;
+
+    clearTransaction(transaction);
+    for (;;) {
+        if (next >= superblock.numJournalBlocks)
+            return 0;
+        if (!read_cache_block(&record, superblock.journalStart + next))
+            return -1;
+        threadBlocksRead++;
+        if (record.magic != JOURNAL_MAGIC || record.sequence != journal.sequence)
+            return 0;
+        if (record.type == JOURNAL_COMMIT_RECORD) {
+            if (record.count != transaction->numBlocks || record.checksum != checksum)
+                return 0;
+            *position = next + 1;
+            return 1;
         }
-        
-        else if (currentDirectory->allocated == 0) {
-            writeDirectoryItem(directory, i);
-            return i;
+        if (record.type != JOURNAL_DESCRIPTOR_RECORD || record.count > JOURNAL_BLOCKS_PER_DESCRIPTOR
+                || next + 1 + record.count >= superblock.numJournalBlocks)
+            return 0;
+        checksum = checksumBlocks(checksum, &record, 1);
+        for (uint32_t i = 0; i < record.count; i++) {
+            if (record.blockIndexes[i] < superblock.inodeBitmapStart || record.blockIndexes[i] >= superblock.numBlocks)
+                return 0;
+            if (!read_cache_block(copy, superblock.journalStart + next + 1 + i))
+                return -1;
+            threadBlocksRead++;
+            checksum = checksumBlocks(checksum, copy, 1);
+            if (!addTransactionBlock(transaction, copy, record.blockIndexes[i]))
+                return 0;
         }
-
-        
+        next += 1 + record.count;
     }
+}
 
-    return -1;
+//Frees the journal's transactions.
+void unloadJournal(void) {
+    pthread_mutex_lock(&journal.lock);
+    for (int i = 0; i < 2; i++) {
+        free(journal.transactions[i].blockIndexes);
+        free(journal.transactions[i].blocks);
+        free(journal.transactions[i].hashSlots);
+        free(journal.transactions[i].freedBlocks);
+        bzero(&journal.transactions[i], sizeof(JournalTransaction));
+    }
+    journal.loaded = 0;
+    pthread_mutex_unlock(&journal.lock);
 }
 
-//Finds a directory given a directory name, and then reads the directory into the given directory pointer
-int findDirectoryItem(DirectoryItem * directory, char* name) {
-    for (int i=FIRST_DIRECTORY_ITEM_BLOCK_INDEX; i <= LAST_DIRECTORY_ITEM_BLOCK_INDEX; i++) {
-        if (!read_sd_block(directory,i))
-            fserror=FS_IO_ERROR;
-        else {
-            if (!strncmp(name, directory->name,MAX_NAME_SIZE - 1  ))
-                return i;
+//Sets up the journal when the filesystem is mounted and replays every transaction committed since the journal last
+//started over, in case the program stopped before the block cache wrote them home. The caller holds the mount lock.
+int loadJournal(void) {
+    JournalRecord header;
+    uint32_t position = 1;
+    int found, replayed = 0;
+
+    journal.maxTransactionBlocks = superblock.numJournalBlocks - 1;
+    while (journal.maxTransactionBlocks > 0 && journalRecordBlocks(journal.maxTransactionBlocks) > superblock.numJournalBlocks - 1)
+        journal.maxTransactionBlocks--;
+    journal.numHashSlots = 1;
+    while (journal.numHashSlots < 2 * journal.maxTransactionBlocks)
+        journal.numHashSlots <<= 1;
+    for (int i = 0; i < 2; i++) {
+        journal.transactions[i].blockIndexes = malloc(journal.maxTransactionBlocks * sizeof(uint32_t));
+        journal.transactions[i].blocks = malloc((unsigned long)journal.maxTransactionBlocks * SOFTWARE_DISK_BLOCK_SIZE);
+        journal.transactions[i].hashSlots = malloc(journal.numHashSlots * sizeof(int));
+        if (!journal.transactions[i].blockIndexes || !journal.transactions[i].blocks || !journal.transactions[i].hashSlots)
+            goto fail;
+        clearTransaction(&journal.transactions[i]);
+    }
+    journal.running = &journal.transactions[0];
+    journal.committing = NULL;
+    journal.numHandles = 0;
+    journal.reservedBlocks = 0;
+    journal.commitsWaiting = 0;
+    journal.aborted = 0;
+    journal.nextRecord = 1;
+    journal.restartPending = 0;
+    if (!read_cache_block(&header, superblock.journalStart) || header.magic != JOURNAL_MAGIC
+            || header.type != JOURNAL_HEADER_RECORD)
+        goto fail;
+    journal.sequence = header.sequence;
+
+    while ((found = readJournalTransaction(journal.running, &position)) > 0) {
+        for (unsigned int i = 0; i < journal.running->numBlocks; i++) {
+            if (!write_cache_block(journal.running->blocks + (unsigned long)i * SOFTWARE_DISK_BLOCK_SIZE,
+                                   journal.running->blockIndexes[i]))
+                goto fail;
         }
+        threadBlocksWritten += journal.running->numBlocks;
+        journal.sequence++;
+        replayed = 1;
     }
+    clearTransaction(journal.running);
+    if (found < 0)
+        goto fail;
+    //Once the replayed blocks are home the journal can start over
+    if (replayed && (!flush_block_cache() || !writeJournalHeader(superblock.journalStart, journal.sequence)))
+        goto fail;
+    journal.loaded = 1;
+    return 1;
 
-    return -1;
+fail:
+    unloadJournal();
+    fserror = FS_IO_ERROR;
+    return 0;
 }
 
+//Writes a transaction to the journal in one sequential write, descriptors listing its blocks, the copies of the
+//blocks and a commit record, and syncs it. The block cache's dirty blocks, file data the transaction points at
+//among them, are written back first and made durable by the same sync, the one barrier between the journal write
+//and the committed blocks going home. The journal starts over, with its header in the same write, when the rest of
+//it is too short, or after a commit that freed an indirect block, so that replay can't write an older copy of that
+//block over its next owner. That drops the transactions in the journal, so the block cache is flushed and synced
+//first instead, putting everything they committed home. The committed blocks are then handed to the block cache,
+//which writes them home whenever it gets to them. Only one commit runs at a time.
+int writeJournalTransaction(JournalTransaction *transaction, uint32_t sequence) {
+    unsigned long numRecords = journalRecordBlocks(transaction->numBlocks);
+    int restart = journal.restartPending || journal.nextRecord + numRecords > superblock.numJournalBlocks;
+    uint32_t firstRecord = restart ? 0 : journal.nextRecord;
+    unsigned char *records, *next;
+    JournalRecord *record;
+    uint32_t checksum = CHECKSUM_SEED;
+    unsigned int count;
+    int ret;
+
+    if (restart ? !flush_block_cache() : !write_back_block_cache())
+        return 0;
 
-int findInodeDataBlockIndex(unsigned short int blockIndex, Inode inode) {
-    IndirectBlock indirectBlock;
-    if (blockIndex < NUM_DIRECTLY_MAPPED_INODE_BLOCKS) {
-        return inode.blocks[blockIndex];
-    }
-    else if (!inode.blocks[NUM_DIRECTLY_MAPPED_INODE_BLOCKS <= NUM_INDIRECT_BLOCK_MAPPINGS]) {
+    records = calloc(numRecords + restart, SOFTWARE_DISK_BLOCK_SIZE);
+    if (!records)
         return 0;
+    next = records;
+    if (restart) {
+        fillJournalHeader((JournalRecord *)next, sequence);
+        next += SOFTWARE_DISK_BLOCK_SIZE;
     }
-    else if (blockIndex - NUM_DIRECTLY_MAPPED_INODE_BLOCKS <= NUM_INDIRECT_BLOCK_MAPPINGS) {
-        if (!read_sd_block(&indirectBlock, inode.blocks[NUM_DIRECTLY_MAPPED_INODE_BLOCKS]))
-            return -1;
-        else
-            return indirectBlock.blocks[blockIndex - NUM_DIRECTLY_MAPPED_INODE_BLOCKS];
+    for (unsigned int i = 0; i < transaction->numBlocks; i += count) {
+        count = transaction->numBlocks - i;
+        if (count > JOURNAL_BLOCKS_PER_DESCRIPTOR)
+            count = JOURNAL_BLOCKS_PER_DESCRIPTOR;
+        record = (JournalRecord *)next;
+        record->magic = JOURNAL_MAGIC;
+        record->type = JOURNAL_DESCRIPTOR_RECORD;
+        record->sequence = sequence;
+        record->count = count;
+        memcpy(record->blockIndexes, transaction->blockIndexes + i, count * sizeof(uint32_t));
+        memcpy(next + SOFTWARE_DISK_BLOCK_SIZE, transaction->blocks + (unsigned long)i * SOFTWARE_DISK_BLOCK_SIZE,
+               (unsigned long)count * SOFTWARE_DISK_BLOCK_SIZE);
+        checksum = checksumBlocks(checksum, next, count + 1);
+        next += (unsigned long)(count + 1) * SOFTWARE_DISK_BLOCK_SIZE;
     }
-    else {
-        return -1;
+    record = (JournalRecord *)next;
+    record->magic = JOURNAL_MAGIC;
+    record->type = JOURNAL_COMMIT_RECORD;
+    record->sequence = sequence;
+    record->count = transaction->numBlocks;
+    record->checksum = checksum;
+    ret = write_cache_blocks_sync(records, superblock.journalStart + firstRecord, numRecords + restart);
+    free(records);
+    if (!ret)
+        return 0;
+    journal.nextRecord = firstRecord + restart + numRecords;
+    if (restart)
+        journal.restartPending = 0;
+
+    for (unsigned int i = 0; i < transaction->numBlocks; i++) {
+        if (!write_cache_block(transaction->blocks + (unsigned long)i * SOFTWARE_DISK_BLOCK_SIZE, transaction->blockIndexes[i]))
+            return 0;
     }
+    threadBlocksWritten += numRecords + transaction->numBlocks;
+    if (transaction->freesMetadata)
+        journal.restartPending = 1;
+    return 1;
 }
 
-//Writes data from buffer to the correct data block index this file's inode points to
-int writeDataBlockFromFile(File file, void * data, unsigned short int blockIndex) {
-   int dataBlockIndex = findInodeDataBlockIndex(blockIndex, file->inode);
-
-   if (dataBlockIndex == 0) {
-       dataBlockIndex = findFreeDataBlockIndex();
-       if (dataBlockIndex < 0) {
-           fserror = FS_OUT_OF_SPACE;
-           return 0;
-       }
-       else {
-           if (!setDataBlockStatus(dataBlockIndex,1)) {
-               fserror = FS_IO_ERROR;
-               return 0;
-           }
-            if (!setInodeDataBlock(blockIndex, dataBlockIndex, file))
-                return 0;
-       }
-   }
-
-   if (!write_sd_block(data, dataBlockIndex)) {
-       fserror = FS_IO_ERROR;
-       return 0;
-   }
-   fserror = FS_NONE;
-   return 1;
-}
-
-//Reads a data block into the data buffer with an index corresponding to this file's inode data blocks
-int readDataBlockFromFile(File file, void *data, unsigned short int blockIndex) {
-    //NOTE: The blockIndex refers to the index of the data block for the file, not the software disk
-    int dataBlockIndex;
-    IndirectBlock indirectBlock;
-    if (blockIndex < NUM_DIRECTLY_MAPPED_INODE_BLOCKS)
-        dataBlockIndex = file->inode.blocks[blockIndex];
-    else {
-        if (!read_sd_block(&indirectBlock, file->inode.blocks[NUM_DIRECTLY_MAPPED_INODE_BLOCKS]))
-            dataBlockIndex = -1;
-        else
-            dataBlockIndex = indirectBlock.blocks[blockIndex - NUM_DIRECTLY_MAPPED_INODE_BLOCKS];
-    }
-    if (dataBlockIndex != -1) {
-        if (!read_sd_block(data, SOFTWARE_DISK_BLOCK_SIZE)) {
-            fserror = FS_IO_ERROR;
-            return 0;
+//Lets the blocks a transaction freed be handed out again now that it has committed.
+void releaseFreedBlocks(JournalTransaction *transaction) {
+    pthread_mutex_lock(&dataBitmap.lock);
+    for (unsigned int i = 0; dataBitmap.loaded && i < transaction->numFreedBlocks; i++) {
+        unsigned int bit = transaction->freedBlocks[i] - superblock.dataStart;
+        if ((dataBitmap.pendingWords[bit / 64] >> (bit % 64)) & 1) {
+            dataBitmap.pendingWords[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+            dataBitmap.numFree++;
+            dataBitmap.numPending--;
         }
-        return 1;
     }
-    return 0;
+    pthread_mutex_unlock(&dataBitmap.lock);
+}
+
+//Commits the running transaction once the operations adding to it are done. Operations that start meanwhile wait
+//and go into the next transaction, and a commit already being written is waited for, so concurrent callers share
+//one commit. The caller holds the journal lock, which is let go while the transaction is written.
+int commitRunningTransaction(void) {
+    JournalTransaction *transaction;
+    uint32_t sequence;
+    int ret;
+
+    journal.commitsWaiting++;
+    while (!journal.aborted && (journal.committing || journal.numHandles > 0))
+        pthread_cond_wait(&journal.changed, &journal.lock);
+    journal.commitsWaiting--;
+    if (journal.aborted)
+        return 0;
+    if (journal.running->numBlocks == 0)
+        return 1;
 
+    transaction = journal.running;
+    sequence = journal.sequence++;
+    journal.committing = transaction;
+    journal.running = &journal.transactions[transaction == &journal.transactions[0]];
+    clearTransaction(journal.running);
+    pthread_cond_broadcast(&journal.changed);
+    pthread_mutex_unlock(&journal.lock);
+
+    ret = writeJournalTransaction(transaction, sequence);
+    if (ret)
+        releaseFreedBlocks(transaction);
+
+    pthread_mutex_lock(&journal.lock);
+    journal.committing = NULL;
+    if (!ret)
+        journal.aborted = 1;
+    pthread_cond_broadcast(&journal.changed);
+    return ret;
 }
 
-File create_file(char *name) {
-    File file = (File) malloc(sizeof(FileInternals));
-    fserror=FS_NONE;
-    bzero(file, sizeof(FileInternals));
-    file->fileMode = READ_WRITE;
+//Commits whatever the running transaction holds. Called without a transaction handle.
+int commitJournal(void) {
+    int ret;
 
-    file->position=0;
+    pthread_mutex_lock(&journal.lock);
+    ret = !journal.loaded || commitRunningTransaction();
+    pthread_mutex_unlock(&journal.lock);
+    if (!ret)
+        fserror = FS_IO_ERROR;
+    return ret;
+}
 
-    file->directory.inodeIndex = findFreeInodeIndex();
-    file->directory.allocated = 1;
-    if (file->directory.inodeIndex < 0)
-        fserror=FS_OUT_OF_SPACE;
-    else {
-        bzero(&file->inode, sizeof(Inode));
-        if (!writeInode(file->directory.inodeIndex, file->inode)) {
-            fserror=FS_IO_ERROR;
+//Opens a handle on the running transaction for an operation that changes at most numBlocks metadata blocks,
+//committing the running transaction first if it might not have room. Everything the operation changes until
+//endTransaction goes into the same transaction. Called before taking any other filesystem lock, since it may wait
+//for other operations to finish.
+int startTransaction(unsigned int numBlocks) {
+    int ret = 1;
+
+    pthread_mutex_lock(&journal.lock);
+    for (;;) {
+        if (journal.aborted || numBlocks > journal.maxTransactionBlocks) {
+            ret = 0;
+            break;
         }
-        
-        else {
-            file->directory.open = 1;
-            strncpy(file->directory.name, name, MAX_NAME_SIZE);
-            int index = createDirectoryItem(file->directory);
-            if (index < 0) {
-                fserror=FS_OUT_OF_SPACE;
-            }
-            else {
-                file->directoryItemBlockIndex = index;
-                if (!setInodeStatus(file->directory.inodeIndex, 1)) {
-                    fserror=FS_IO_ERROR;
-                }
-                else
-                    return file;
-            }
+        if (journal.commitsWaiting > 0)
+            pthread_cond_wait(&journal.changed, &journal.lock);
+        else if (journal.running->numBlocks + journal.reservedBlocks + numBlocks <= journal.maxTransactionBlocks) {
+            journal.numHandles++;
+            journal.reservedBlocks += numBlocks;
+            break;
+        }
+        else if (!commitRunningTransaction()) {
+            ret = 0;
+            break;
         }
     }
+    pthread_mutex_unlock(&journal.lock);
+    if (!ret)
+        fserror = FS_IO_ERROR;
+    return ret;
+}
 
-    return 0;
+//Closes a handle opened by startTransaction for numBlocks blocks.
+void endTransaction(unsigned int numBlocks) {
+    pthread_mutex_lock(&journal.lock);
+    journal.numHandles--;
+    journal.reservedBlocks -= numBlocks;
+    if (journal.numHandles == 0)
+        pthread_cond_broadcast(&journal.changed);
+    pthread_mutex_unlock(&journal.lock);
 }
 
-unsigned long write_file(File file, void *buf, unsigned long numbytes) {
-    fserror=FS_NONE;
-    unsigned char bytes[SOFTWARE_DISK_BLOCK_SIZE];
-    int bytesWritten = 0;
-    if (!file) {
-        fserror = FS_FILE_NOT_OPEN;
-    }
-    else if (!file->directory.open) {
-        fserror=FS_FILE_NOT_OPEN;
-    }
-    else if (file->position + numbytes > MAX_FILE_BYTES) {
-        fserror = FS_OUT_OF_SPACE;
-    }
-    else if (file->fileMode == READ_ONLY) {
-        fserror = FS_FILE_READ_ONLY;
-    }
-    else {
-        while (numbytes > 0) {
-            if (!readDataBlockFromFile(file, bytes, file->position / SOFTWARE_DISK_BLOCK_SIZE)) {
-                fserror =  FS_IO_ERROR;
-                break;
-            }
+//Most metadata blocks an operation changes that maps numFileBlocks blocks of one file: the indirect blocks mapping
+//them and the double indirect block, the inode, a directory block and every bitmap block.
+unsigned int operationBlocks(unsigned long numFileBlocks) {
+    unsigned long numMapBlocks = numFileBlocks / NUM_INDIRECT_BLOCK_MAPPINGS + 2;
+    if (numMapBlocks > NUM_MAP_BLOCKS)
+        numMapBlocks = NUM_MAP_BLOCKS;
+    return numMapBlocks + 1 + 2 + superblock.numInodeBitmapBlocks + superblock.numDataBitmapBlocks;
+}
 
-            int offset = file->position % SOFTWARE_DISK_BLOCK_SIZE;
-            int bytesToCopy;
-            if (SOFTWARE_DISK_BLOCK_SIZE - offset > numbytes)
-                bytesToCopy = numbytes;
-            else
-                bytesToCopy = SOFTWARE_DISK_BLOCK_SIZE - offset;
-            memcpy(bytes + offset, buf + bytesWritten, bytesToCopy);
+//Reads a metadata block as the running transaction, or the one being committed, left it.
+int readMetadataBlock(void *buf, uint32_t blockIndex) {
+    unsigned char *copy;
+
+    pthread_mutex_lock(&journal.lock);
+    copy = findTransactionBlock(journal.running, blockIndex);
+    if (!copy && journal.committing)
+        copy = findTransactionBlock(journal.committing, blockIndex);
+    if (copy)
+        memcpy(buf, copy, SOFTWARE_DISK_BLOCK_SIZE);
+    pthread_mutex_unlock(&journal.lock);
+    if (copy)
+        return 1;
+    threadBlocksRead++;
+    return read_cache_block(buf, blockIndex);
+}
 
-            if (!writeDataBlockFromFile(file, bytes, file->position / SOFTWARE_DISK_BLOCK_SIZE)) {
-                fserror = FS_OUT_OF_SPACE;
-                break;
-            }
+//Adds a changed metadata block to the running transaction. The caller has a transaction handle.
+int writeMetadataBlock(void *buf, uint32_t blockIndex) {
+    int ret;
 
-            numbytes -= bytesToCopy;
-            bytesWritten += bytesToCopy;
-            file->position += bytesToCopy;
-            file->inode.fileSize += bytesToCopy;
-        }
+    pthread_mutex_lock(&journal.lock);
+    ret = addTransactionBlock(journal.running, buf, blockIndex);
+    pthread_mutex_unlock(&journal.lock);
+    if (!ret)
+        fserror = FS_IO_ERROR;
+    return ret;
+}
 
-    }
+//Drops the inode table, including changes that weren't written back.
+void unloadInodeTable(void) {
+    pthread_mutex_lock(&inodeTable.lock);
+    free(inodeTable.blocks);
+    free(inodeTable.dirtyBlocks);
+    free(inodeTable.dirtyList);
+    inodeTable.blocks = NULL;
+    inodeTable.dirtyBlocks = NULL;
+    inodeTable.dirtyList = NULL;
+    inodeTable.numDirty = 0;
+    pthread_mutex_unlock(&inodeTable.lock);
+}
 
-    return bytesWritten;
+//Reads the inode table into memory. The caller holds the mount lock, after the journal has been replayed.
+int loadInodeTable(void) {
+    inodeTable.blocks = malloc((unsigned long)superblock.numInodeTableBlocks * SOFTWARE_DISK_BLOCK_SIZE);
+    inodeTable.dirtyBlocks = calloc(superblock.numInodeTableBlocks, 1);
+    inodeTable.dirtyList = malloc(superblock.numInodeTableBlocks * sizeof(unsigned int));
+    inodeTable.numDirty = 0;
+    if (!inodeTable.blocks || !inodeTable.dirtyBlocks || !inodeTable.dirtyList
+            || !read_cache_blocks(inodeTable.blocks, superblock.inodeTableStart, superblock.numInodeTableBlocks)) {
+        unloadInodeTable();
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    threadBlocksRead += superblock.numInodeTableBlocks;
+    return 1;
 }
 
-unsigned long read_file(File file, void *buf, unsigned long numbytes) {
-    unsigned char bytes[SOFTWARE_DISK_BLOCK_SIZE];
-    unsigned long bytesRead = 0;
+//Reads the superblock, the inode table and the directory the first time the filesystem is used and sets up the
+//bitmaps from the superblock. The superblock has to describe exactly the layout fs_format would have chosen, on a
+//disk at least as large as it says.
+int mountFilesystem(void) {
+    static int exitHookRegistered = 0;
+    SuperblockBlock block;
+    Superblock expected;
 
-    if (file->position + numbytes > file->inode.fileSize)
-        numbytes = file->inode.fileSize - file->position;
+    if (__atomic_load_n(&mounted, __ATOMIC_ACQUIRE))
+        return 1;
+    pthread_mutex_lock(&mountLock);
+    if (mounted) {
+        pthread_mutex_unlock(&mountLock);
+        return 1;
+    }
+    if (!read_cache_block(&block, SUPERBLOCK_INDEX) || block.superblock.magic != FILESYSTEM_MAGIC
+            || block.superblock.version != FILESYSTEM_VERSION || block.superblock.numBlocks > software_disk_size()
+            || !computeLayout(&expected, block.superblock.numBlocks, block.superblock.numInodes, block.superblock.numDirectoryItems,
+                              block.superblock.maxFileSize)
+            || memcmp(&expected, &block.superblock, sizeof(Superblock))) {
+        pthread_mutex_unlock(&mountLock);
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    superblock = block.superblock;
+    if (!loadJournal()) {
+        pthread_mutex_unlock(&mountLock);
+        return 0;
+    }
+    if (!loadInodeTable()) {
+        unloadJournal();
+        pthread_mutex_unlock(&mountLock);
+        return 0;
+    }
 
-    if (file->directory.open == 0)
-        fserror=FS_FILE_NOT_OPEN;
-    else {
-        while (numbytes > 0) {
-            if (!readDataBlockFromFile(file, bytes, file->position / SOFTWARE_DISK_BLOCK_SIZE))
-                fserror=FS_OUT_OF_SPACE;
-            else {
-                int offset = file->position % SOFTWARE_DISK_BLOCK_SIZE;
-                int bytesToCopy;
-                if (SOFTWARE_DISK_BLOCK_SIZE - offset > numbytes)
-                    bytesToCopy = numbytes;
-                else
-                    bytesToCopy = SOFTWARE_DISK_BLOCK_SIZE - offset;
-                
-                memcpy(buf+bytesRead, bytes+offset, bytesToCopy);
-                numbytes -= bytesToCopy;
-                file->position += bytesToCopy;
-                bytesRead += bytesToCopy;
-            }
-        }
+    resetBitmap(&inodeBitmap, superblock.inodeBitmapStart, superblock.numInodeBitmapBlocks, superblock.numInodes);
+    resetBitmap(&dataBitmap, superblock.dataBitmapStart, superblock.numDataBitmapBlocks, superblock.numDataBlocks);
+    if (!loadDirectoryIndex()) {
+        unloadInodeTable();
+        unloadJournal();
+        pthread_mutex_unlock(&mountLock);
+        return 0;
     }
+    if (!exitHookRegistered) {
+        atexit(flushAtExit);
+        exitHookRegistered = 1;
+    }
+    __atomic_store_n(&mounted, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mountLock);
+    return 1;
+}
 
-    return 0;
+//Drops everything read from the disk, including changes the journal hasn't committed, so the next use of the
+//filesystem reads the superblock again. Nothing else may be using the filesystem.
+void unmountFilesystem(void) {
+    pthread_mutex_lock(&mountLock);
+    unloadJournal();
+    unloadInodeTable();
+    resetBitmap(&inodeBitmap, 0, 0, 0);
+    resetBitmap(&dataBitmap, 0, 0, 0);
+    free(directoryIndex.buckets);
+    free(directoryIndex.next);
+    free(directoryIndex.nameHashes);
+    free(directoryIndex.freeSlots);
+    free(directoryIndex.openSlots);
+    free(directoryIndex.openSlotFiles);
+    bzero(&directoryIndex, sizeof(DirectoryIndex));
+    __atomic_store_n(&mounted, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mountLock);
 }
 
-int seek_file(File file, unsigned long bytepos) {
-    if (!file) {
-        fserror=FS_FILE_NOT_OPEN;
-        return 0;
-    }
-    else {
-        if (bytepos >= MAX_FILE_BYTES) {
-            fserror=FS_EXCEEDS_MAX_FILE_SIZE;
+//Writes the changed blocks of the inode table and the bitmaps back through the journal. They are only written here,
+//not on every change, so a block changed several times by an operation is copied into its transaction once. The
+//caller has a transaction handle.
+int writeBackMetadata(void) {
+    Bitmap *bitmaps[] = { &inodeBitmap, &dataBitmap };
+
+    pthread_mutex_lock(&inodeTable.lock);
+    while (inodeTable.numDirty > 0) {
+        unsigned int block = inodeTable.dirtyList[inodeTable.numDirty - 1];
+        if (!writeMetadataBlock(&inodeTable.blocks[block], superblock.inodeTableStart + block)) {
+            pthread_mutex_unlock(&inodeTable.lock);
             return 0;
         }
-        else {
-            file->position = bytepos;
-            if (file->position > file->inode.fileSize) {
-                file->inode.fileSize = bytepos;
-                return writeInode(file->directory.inodeIndex, file->inode);
+        inodeTable.dirtyBlocks[block] = 0;
+        inodeTable.numDirty--;
+    }
+    pthread_mutex_unlock(&inodeTable.lock);
+    for (int i = 0; i < 2; i++) {
+        pthread_mutex_lock(&bitmaps[i]->lock);
+        for (unsigned int j = 0; bitmaps[i]->loaded && j < bitmaps[i]->numDiskBlocks; j++) {
+            if (!bitmaps[i]->dirtyBlocks[j])
+                continue;
+            if (!writeMetadataBlock(bitmaps[i]->words + j * BITMAP_WORDS, bitmaps[i]->diskBlockIndex + j)) {
+                pthread_mutex_unlock(&bitmaps[i]->lock);
+                return 0;
             }
+            bitmaps[i]->dirtyBlocks[j] = 0;
         }
+        pthread_mutex_unlock(&bitmaps[i]->lock);
     }
+    return 1;
+}
 
+//Reads the bitmap from disk the first time it is used. It stays in memory afterwards. The caller holds the
+//bitmap's lock.
+int loadBitmap(Bitmap *bitmap) {
+    if (bitmap->loaded)
+        return 1;
+    bitmap->words = malloc((unsigned long)bitmap->numDiskBlocks * SOFTWARE_DISK_BLOCK_SIZE);
+    bitmap->pendingWords = calloc(bitmap->numDiskBlocks, SOFTWARE_DISK_BLOCK_SIZE);
+    bitmap->dirtyBlocks = calloc(bitmap->numDiskBlocks, 1);
+    if (!bitmap->words || !bitmap->pendingWords || !bitmap->dirtyBlocks
+            || !read_cache_blocks(bitmap->words, bitmap->diskBlockIndex, bitmap->numDiskBlocks)) {
+        free(bitmap->words);
+        free(bitmap->pendingWords);
+        free(bitmap->dirtyBlocks);
+        bitmap->words = NULL;
+        bitmap->pendingWords = NULL;
+        bitmap->dirtyBlocks = NULL;
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    threadBlocksRead += bitmap->numDiskBlocks;
+    bitmap->loaded = 1;
+    bitmap->nextFreeWord = 0;
+    bitmap->numFree = bitmap->numBits;
+    bitmap->numPending = 0;
+    for (unsigned long i = 0; i < (unsigned long)bitmap->numDiskBlocks * BITMAP_WORDS; i++)
+        bitmap->numFree -= __builtin_popcountll(bitmap->words[i]);
     return 1;
 }
 
-unsigned long file_length(File file) {
-    return file->inode.fileSize;
+//Tells whether a bit of a loaded bitmap is set.
+int testBit(Bitmap *bitmap, unsigned int index) {
+    return (bitmap->words[index / 64] >> (index % 64)) & 1;
 }
 
-int delete_file(char *name) {
+//Tells whether a bit of a loaded bitmap can't be handed out: it is set, or pending a commit.
+int testBusyBit(Bitmap *bitmap, unsigned int index) {
+    return ((bitmap->words[index / 64] | bitmap->pendingWords[index / 64]) >> (index % 64)) & 1;
+}
 
-    DirectoryItem * directory = (DirectoryItem*) malloc(sizeof(DirectoryItem));
-    int blockIndex;
-    blockIndex = findDirectoryItem(directory, name);
-    if (blockIndex < 0) {
-        fserror = FS_FILE_NOT_FOUND;
+//Sets a bit in the bitmap to either not-in-use or in-use.
+int setBitmapStatus(Bitmap *bitmap, unsigned int index, int status) {
+    pthread_mutex_lock(&bitmap->lock);
+    if (!loadBitmap(bitmap)) {
+        pthread_mutex_unlock(&bitmap->lock);
         return 0;
     }
-    else if (directory->open) {
-        fserror = FS_FILE_OPEN;
-        return 0;
-    }
-    else {
-        bzero(directory,sizeof(DirectoryItem));
-        if (!write_sd_block(directory, blockIndex))
-        {
-            fserror = FS_IO_ERROR;
-            return 0;
+    if (testBit(bitmap, index) != !!status)
+        bitmap->numFree += status ? -1 : 1;
+    if (status)
+        bitmap->words[index / 64] |= (uint64_t)1 << (index % 64);
+    else
+        bitmap->words[index / 64] &= ~((uint64_t)1 << (index % 64));
+    bitmap->dirtyBlocks[index / BITS_PER_BITMAP_BLOCK] = 1;
+    pthread_mutex_unlock(&bitmap->lock);
+    return 1;
+}
+
+//Finds the first clear bit in the bitmap, a whole word at a time, starting from where the last search ended and
+//wrapping around, and sets it. The bit comes out of the count in reserved, bits the caller set aside with reserveBits,
+//while any are left there; reserved may be NULL. Returns the bit, or -1 if every bit is set or set aside.
+int allocateBit(Bitmap *bitmap, unsigned int *reserved) {
+    int index = -1;
+    unsigned int i = 0;
+
+    pthread_mutex_lock(&bitmap->lock);
+    if (loadBitmap(bitmap) && (bitmap->numFree > 0 || (reserved && *reserved > 0))) {
+        unsigned int numWords = (bitmap->numBits + 63) / 64;
+        for (; i < numWords && index < 0; i++) {
+            unsigned int word = (bitmap->nextFreeWord + i) % numWords;
+            uint64_t freeBits = ~(bitmap->words[word] | bitmap->pendingWords[word]);
+            if (freeBits && word * 64 + __builtin_ctzll(freeBits) < bitmap->numBits) {
+                index = word * 64 + __builtin_ctzll(freeBits);
+                bitmap->words[word] |= (uint64_t)1 << (index % 64);
+                bitmap->dirtyBlocks[index / BITS_PER_BITMAP_BLOCK] = 1;
+                bitmap->nextFreeWord = word;
+                if (reserved && *reserved > 0)
+                    (*reserved)--;
+                else
+                    bitmap->numFree--;
+            }
         }
     }
-
-    return 1;
-    
+    pthread_mutex_unlock(&bitmap->lock);
+    countPath(FS_PATH_BITMAP_SCAN, 1, i);
+    return index;
 }
 
-File open_file(char *name, FileMode mode) {
-    File file = (File) malloc(sizeof(FileInternals));
+//Finds the longest run of clear bits between from and to, stopping at the first run count bits long. Its first bit
+//goes in start. Returns its length, counting the words it examined. The caller holds the bitmap's lock.
+unsigned int findClearRun(Bitmap *bitmap, unsigned int from, unsigned int to, unsigned int count, unsigned int *start) {
+    unsigned int bit = from, runStart, longest = 0;
 
-    bzero(file, sizeof(FileInternals));
-    file->position = 0;
-    fserror = FS_NONE;
-    file->fileMode = mode;
+    while (bit < to && longest < count) {
+        if (bit % 64 == 0 && (bitmap->words[bit / 64] | bitmap->pendingWords[bit / 64]) == ~(uint64_t)0) {
+            bit += 64;
+            continue;
+        }
+        if (testBusyBit(bitmap, bit)) {
+            bit++;
+            continue;
+        }
+        runStart = bit;
+        while (bit < to && bit - runStart < count && !testBusyBit(bitmap, bit))
+            bit++;
+        if (bit - runStart > longest) {
+            longest = bit - runStart;
+            *start = runStart;
+        }
+    }
+    countPath(FS_PATH_BITMAP_SCAN, 0, bit > from ? (bit - 1) / 64 - from / 64 + 1 : 0);
+    return longest;
+}
+
+//Sets a run of up to count clear bits: the first run that long, searching from where the last search ended and
+//wrapping around, or else the longest run there is. The bits come out of reserved first, as in allocateBit. Stores
+//how many bits were set in runLength. Returns the first bit, or -1 if every bit is set or set aside.
+int allocateBitRun(Bitmap *bitmap, unsigned int count, unsigned int *reserved, unsigned int *runLength) {
+    unsigned int start = 0, length = 0, wrappedStart = 0, wrappedLength, searchStart, fromReserved;
+    int index = -1;
+
+    pthread_mutex_lock(&bitmap->lock);
+    if (loadBitmap(bitmap)) {
+        if (count > bitmap->numFree + (reserved ? *reserved : 0))
+            count = bitmap->numFree + (reserved ? *reserved : 0);
+        searchStart = bitmap->nextFreeWord * 64;
+        if (searchStart > bitmap->numBits)
+            searchStart = 0;
+        length = findClearRun(bitmap, searchStart, bitmap->numBits, count, &start);
+        if (length < count) {
+            wrappedLength = findClearRun(bitmap, 0, searchStart, count, &wrappedStart);
+            if (wrappedLength > length) {
+                length = wrappedLength;
+                start = wrappedStart;
+            }
+        }
+        if (length > 0) {
+            for (unsigned int i = start; i < start + length; i++) {
+                bitmap->words[i / 64] |= (uint64_t)1 << (i % 64);
+                bitmap->dirtyBlocks[i / BITS_PER_BITMAP_BLOCK] = 1;
+            }
+            fromReserved = reserved ? (*reserved < length ? *reserved : length) : 0;
+            if (reserved)
+                *reserved -= fromReserved;
+            bitmap->numFree -= length - fromReserved;
+            bitmap->nextFreeWord = (start + length) / 64;
+            index = start;
+        }
+    }
+    pthread_mutex_unlock(&bitmap->lock);
+    countPath(FS_PATH_BITMAP_SCAN, 1, 0);
+    *runLength = length;
+    return index;
+}
+
+//Sets aside count clear bits for later allocations that take them out of the count they're given as reserved. Other
+//allocations leave them alone. Returns 0 if there aren't that many.
+int reserveBits(Bitmap *bitmap, unsigned int count) {
+    int ret = 0;
+
+    pthread_mutex_lock(&bitmap->lock);
+    if (loadBitmap(bitmap) && bitmap->numFree >= count) {
+        bitmap->numFree -= count;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&bitmap->lock);
+    return ret;
+}
+
+//Gives back bits set aside by reserveBits.
+void releaseBits(Bitmap *bitmap, unsigned int count) {
+    pthread_mutex_lock(&bitmap->lock);
+    bitmap->numFree += count;
+    pthread_mutex_unlock(&bitmap->lock);
+}
+
+//Sets an inode's status to either not-in-use or in-use. This is done by associating each bit
+//within the bitmap with the index of each inode.
+int setInodeStatus(unsigned int inodeIndex, int status) {
+    return setBitmapStatus(&inodeBitmap, inodeIndex, status);
+}
+
+//Sets a file data block to either not-in-use or in-use. This is done by associating each
+//bit within the bitmap with each block of the data region.
+int setDataBlockStatus(uint32_t blockIndex, int status) {
+    return setBitmapStatus(&dataBitmap, blockIndex - superblock.dataStart, status);
+}
+
+//Frees a data region block that a committed inode or indirect block may still point to. Until the running
+//transaction commits, a crash would bring the old owner back, so the block stays pending and isn't handed out
+//again. metadata is set for an indirect block. The caller has a transaction handle.
+int freeDataBlockAfterCommit(uint32_t blockIndex, int metadata) {
+    JournalTransaction *running;
+    uint32_t *freedBlocks;
+    unsigned int bit = blockIndex - superblock.dataStart;
+    int ret = 1;
+
+    pthread_mutex_lock(&journal.lock);
+    running = journal.running;
+    if (running->numFreedBlocks == running->maxFreedBlocks) {
+        freedBlocks = realloc(running->freedBlocks, (running->maxFreedBlocks * 2 + 64) * sizeof(uint32_t));
+        if (freedBlocks) {
+            running->freedBlocks = freedBlocks;
+            running->maxFreedBlocks = running->maxFreedBlocks * 2 + 64;
+        }
+        else
+            ret = 0;
+    }
+    if (ret) {
+        running->freedBlocks[running->numFreedBlocks++] = blockIndex;
+        running->freesMetadata |= metadata;
+    }
+    pthread_mutex_unlock(&journal.lock);
+
+    pthread_mutex_lock(&dataBitmap.lock);
+    if (!ret || !loadBitmap(&dataBitmap))
+        ret = 0;
+    else if (bit < dataBitmap.numBits && testBit(&dataBitmap, bit)) {
+        dataBitmap.words[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+        dataBitmap.pendingWords[bit / 64] |= (uint64_t)1 << (bit % 64);
+        dataBitmap.dirtyBlocks[bit / BITS_PER_BITMAP_BLOCK] = 1;
+        dataBitmap.numPending++;
+    }
+    pthread_mutex_unlock(&dataBitmap.lock);
+    if (!ret)
+        fserror = FS_IO_ERROR;
+    return ret;
+}
+
+//Commits the running transaction if fewer than numBlocks data blocks are free while blocks freed by it are still
+//pending, so an operation about to allocate that many can have them. Called without a transaction handle.
+void reclaimFreedBlocks(unsigned long numBlocks) {
+    int commit;
+
+    pthread_mutex_lock(&dataBitmap.lock);
+    commit = dataBitmap.loaded && dataBitmap.numPending > 0 && dataBitmap.numFree < numBlocks;
+    pthread_mutex_unlock(&dataBitmap.lock);
+    if (commit)
+        commitJournal();
+}
+
+//Frees the mappings of an indirect block, and the indirect block itself, once the running transaction commits.
+//For the double indirect block, levels is 2 and each mapping is an indirect block to free in turn.
+int freeIndirectBlock(uint32_t blockIndex, int levels) {
+    IndirectBlock indirect;
+
+    if (!readMetadataBlock(&indirect, blockIndex)) {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    for (unsigned int i = 0; i < NUM_INDIRECT_BLOCK_MAPPINGS; i++) {
+        if (indirect.blocks[i] == 0)
+            continue;
+        if (levels > 1 ? !freeIndirectBlock(indirect.blocks[i], levels - 1)
+                       : !freeDataBlockAfterCommit(indirect.blocks[i] & ~UNWRITTEN_BLOCK, 0))
+            return 0;
+    }
+    return freeDataBlockAfterCommit(blockIndex, 1);
+}
+
+//Frees every block an inode maps, including its indirect blocks, once the running transaction commits. The caller
+//has a transaction handle.
+int freeInodeBlocks(Inode *inode) {
+    if (inode->flags & INODE_INLINE_DATA)
+        return 1;
+    for (int i = 0; i < NUM_DIRECTLY_MAPPED_INODE_BLOCKS; i++) {
+        if (inode->blocks[i] && !freeDataBlockAfterCommit(inode->blocks[i] & ~UNWRITTEN_BLOCK, 0))
+            return 0;
+    }
+    if (inode->blocks[INDIRECT_BLOCK_SLOT] && !freeIndirectBlock(inode->blocks[INDIRECT_BLOCK_SLOT], 1))
+        return 0;
+    if (inode->blocks[DOUBLE_INDIRECT_BLOCK_SLOT] && !freeIndirectBlock(inode->blocks[DOUBLE_INDIRECT_BLOCK_SLOT], 2))
+        return 0;
+    return 1;
+}
+
+//Writes an inode to the specified inodeIndex in the inode table. Its block goes through the journal the next time
+//the operation writes back its metadata, however many of its inodes changed by then. The caller has a transaction
+//handle.
+int writeInode(unsigned int inodeIndex, Inode inode) {
+    unsigned int block = inodeIndex / INODES_PER_INODE_BLOCK;
+
+    if (inodeIndex >= superblock.numInodes) {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    pthread_mutex_lock(&inodeTable.lock);
+    inodeTable.blocks[block].inodes[inodeIndex % INODES_PER_INODE_BLOCK] = inode;
+    if (!inodeTable.dirtyBlocks[block]) {
+        inodeTable.dirtyBlocks[block] = 1;
+        inodeTable.dirtyList[inodeTable.numDirty++] = block;
+    }
+    pthread_mutex_unlock(&inodeTable.lock);
+    return 1;
+}
+
+//Reads the inode at the specified inodeIndex from the inode table.
+int readInode(unsigned int inodeIndex, Inode *inode) {
+    if (inodeIndex >= superblock.numInodes) {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    pthread_mutex_lock(&inodeTable.lock);
+    *inode = inodeTable.blocks[inodeIndex / INODES_PER_INODE_BLOCK].inodes[inodeIndex % INODES_PER_INODE_BLOCK];
+    pthread_mutex_unlock(&inodeTable.lock);
+    return 1;
+}
+
+//Marks the first available data block in use, out of reserved first, and returns its disk block index, or -1 if
+//the data region is full.
+int allocateDataBlockIndex(unsigned int *reserved) {
+    int bit = allocateBit(&dataBitmap, reserved);
+    if (bit < 0)
+        return -1;
+    return superblock.dataStart + bit;
+}
+
+//Allocates a data block to hold one of the file's indirect blocks. Returns the disk block index, or -1 on failure.
+int allocateIndirectBlock(File file) {
+    int blockIndex = allocateDataBlockIndex(&file->numAllocatingBlocks);
+    if (blockIndex < 0 && fserror == FS_NONE)
+        fserror = FS_OUT_OF_SPACE;
+    return blockIndex;
+}
+
+//Finds the disk block holding one of the file's indirect blocks (numbered as in mapBlocks), or 0 if it hasn't
+//been allocated yet.
+uint32_t findMapBlockIndex(File file, unsigned int mapBlock) {
+    if (mapBlock == 0)
+        return file->inode.blocks[INDIRECT_BLOCK_SLOT];
+    else
+        return file->doubleIndirectBlock.blocks[mapBlock - 1];
+}
+
+//Reads the file's indirect blocks into its handle the first time a block past the direct blocks is needed.
+//Indirect blocks the file doesn't have yet are left empty.
+int loadBlockMap(File file) {
+    uint32_t mapBlockIndex;
+    unsigned long numRead = !!file->inode.blocks[DOUBLE_INDIRECT_BLOCK_SLOT];
+
+    if (file->mapBlocks)
+        return 1;
+    file->mapBlocks = calloc(NUM_MAP_BLOCKS, sizeof(IndirectBlock));
+    if (!file->mapBlocks) {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    bzero(&file->doubleIndirectBlock, sizeof(IndirectBlock));
+    if (file->inode.blocks[DOUBLE_INDIRECT_BLOCK_SLOT]
+            && !readMetadataBlock(&file->doubleIndirectBlock, file->inode.blocks[DOUBLE_INDIRECT_BLOCK_SLOT]))
+        goto fail;
+    for (unsigned int i = 0; i < NUM_MAP_BLOCKS; i++) {
+        mapBlockIndex = findMapBlockIndex(file, i);
+        if (mapBlockIndex && !readMetadataBlock(&file->mapBlocks[i], mapBlockIndex))
+            goto fail;
+        numRead += !!mapBlockIndex;
+    }
+    countPath(FS_PATH_INDIRECT_LOOKUP, 0, numRead);
+    return 1;
+
+fail:
+    free(file->mapBlocks);
+    file->mapBlocks = NULL;
+    fserror = FS_IO_ERROR;
+    return 0;
+}
+
+//Writes back whichever of the file's indirect blocks changed while the file was open, through the journal. The
+//caller has a transaction handle.
+int writeBackBlockMap(File file) {
+    if (!file->mapBlocks)
+        return 1;
+    for (unsigned int i = 0; i < NUM_MAP_BLOCKS; i++) {
+        if (file->mapBlockDirty[i]) {
+            if (!writeMetadataBlock(&file->mapBlocks[i], findMapBlockIndex(file, i)))
+                return 0;
+            file->mapBlockDirty[i] = 0;
+        }
+    }
+    if (file->doubleIndirectBlockDirty) {
+        if (!writeMetadataBlock(&file->doubleIndirectBlock, file->inode.blocks[DOUBLE_INDIRECT_BLOCK_SLOT]))
+            return 0;
+        file->doubleIndirectBlockDirty = 0;
+    }
+    return 1;
+}
+
+//Sets one of the inode's blocks to the given block index. Mappings past the direct blocks only change the
+//resident indirect blocks, which are written back when the file is closed. Indirect blocks are allocated as
+//they are needed.
+int setInodeDataBlock(unsigned int blockIndex, uint32_t overwriteBlockIndex, File file) {
+    unsigned int mapBlock;
+    int newIndirectBlockIndex;
+
+    file->inodeDirty = 1;
+    file->blocksMapped = 1;
+    if (blockIndex < NUM_DIRECTLY_MAPPED_INODE_BLOCKS) {
+        file->inode.blocks[blockIndex] = overwriteBlockIndex;
+        return 1;
+    }
+    if (!loadBlockMap(file))
+        return 0;
+    blockIndex -= NUM_DIRECTLY_MAPPED_INODE_BLOCKS;
+    mapBlock = blockIndex / NUM_INDIRECT_BLOCK_MAPPINGS;
+
+    //Creates the double indirect block if this block is mapped through it and the iNode doesn't have one yet
+    if (mapBlock > 0 && !file->inode.blocks[DOUBLE_INDIRECT_BLOCK_SLOT]) {
+        newIndirectBlockIndex = allocateIndirectBlock(file);
+        if (newIndirectBlockIndex < 0)
+            return 0;
+        file->inode.blocks[DOUBLE_INDIRECT_BLOCK_SLOT] = newIndirectBlockIndex;
+        file->doubleIndirectBlockDirty = 1;
+    }
+
+    //Creates the indirect block that maps this block if it doesn't exist yet
+    if (!findMapBlockIndex(file, mapBlock)) {
+        newIndirectBlockIndex = allocateIndirectBlock(file);
+        if (newIndirectBlockIndex < 0)
+            return 0;
+        if (mapBlock == 0)
+            file->inode.blocks[INDIRECT_BLOCK_SLOT] = newIndirectBlockIndex;
+        else {
+            file->doubleIndirectBlock.blocks[mapBlock - 1] = newIndirectBlockIndex;
+            file->doubleIndirectBlockDirty = 1;
+        }
+    }
+
+    file->mapBlocks[mapBlock].blocks[blockIndex % NUM_INDIRECT_BLOCK_MAPPINGS] = overwriteBlockIndex;
+    file->mapBlockDirty[mapBlock] = 1;
+    return 1;
+}
+
+
+
+//Marks the first available inode in use and returns its index, or -1 if every inode is in use.
+int allocateInodeIndex(void) {
+    return allocateBit(&inodeBitmap, NULL);
+}
+
+//Writes the given directory item into the given directory slot through the journal, leaving the other items in its
+//block alone. The caller holds the directory lock exclusively and has a transaction handle.
+int writeDirectoryItem(DirectoryItem directory, unsigned int slot) {
+    DirectoryBlock directoryBlock;
+    uint32_t blockIndex = superblock.directoryStart + slot / DIRECTORY_ITEMS_PER_BLOCK;
+
+    if (!readMetadataBlock(&directoryBlock, blockIndex))
+        return 0;
+    directoryBlock.items[slot % DIRECTORY_ITEMS_PER_BLOCK] = directory;
+    return writeMetadataBlock(&directoryBlock, blockIndex);
+}
+
+//Tells whether a handle has the file in the given directory slot open.
+int isSlotOpen(unsigned int slot) {
+    return __atomic_load_n(&directoryIndex.openSlots[slot], __ATOMIC_ACQUIRE) != 0;
+}
+
+//Marks the file in the given directory slot open by the file, unless a handle has it open already. Returns 0 if one
+//does. The caller holds the directory lock.
+int openSlot(unsigned int slot, File file) {
+    uint32_t closed = 0;
+
+    file->generation = __atomic_add_fetch(&lastGeneration, 1, __ATOMIC_RELAXED);
+    if (file->generation == 0)
+        file->generation = __atomic_add_fetch(&lastGeneration, 1, __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&directoryIndex.openSlots[slot], &closed, file->generation, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return 0;
+    //Only handles given out later look it up
+    __atomic_store_n(&directoryIndex.openSlotFiles[slot], file, __ATOMIC_RELEASE);
+    return 1;
+}
+
+//Reads the directory item stored in the given directory slot.
+int readDirectoryItem(DirectoryItem * directory, unsigned int slot) {
+    DirectoryBlock directoryBlock;
+    if (!readMetadataBlock(&directoryBlock, superblock.directoryStart + slot / DIRECTORY_ITEMS_PER_BLOCK))
+        return 0;
+    *directory = directoryBlock.items[slot % DIRECTORY_ITEMS_PER_BLOCK];
+    return 1;
+}
+
+//Hashes a filename (FNV-1a), looking at no more characters than findDirectoryItem compares.
+uint32_t hashName(char *name) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < MAX_NAME_SIZE - 1 && name[i]; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+//Adds a directory slot to the hash chain for the given name.
+void indexDirectoryItem(int slot, char *name) {
+    uint32_t hash = hashName(name);
+    int bucket = hash & (directoryIndex.numBuckets - 1);
+    directoryIndex.nameHashes[slot] = hash;
+    directoryIndex.next[slot] = directoryIndex.buckets[bucket];
+    directoryIndex.buckets[bucket] = slot;
+}
+
+//Builds the directory index by reading every directory block once, in a single request.
+int loadDirectoryIndex(void) {
+    DirectoryItem *directoryItems;
+    unsigned int numSlots = superblock.numDirectoryItems;
+    if (directoryIndex.loaded)
+        return 1;
+
+    directoryIndex.numBuckets = 1;
+    while (directoryIndex.numBuckets < 2 * numSlots)
+        directoryIndex.numBuckets <<= 1;
+    directoryIndex.buckets = malloc(directoryIndex.numBuckets * sizeof(int));
+    directoryIndex.next = malloc(numSlots * sizeof(int));
+    directoryIndex.nameHashes = malloc(numSlots * sizeof(uint32_t));
+    directoryIndex.freeSlots = malloc(numSlots * sizeof(unsigned int));
+    directoryIndex.openSlots = calloc(numSlots, sizeof(uint32_t));
+    directoryIndex.openSlotFiles = calloc(numSlots, sizeof(File));
+    directoryItems = malloc((unsigned long)superblock.numDirectoryBlocks * sizeof(DirectoryBlock));
+    if (!directoryIndex.buckets || !directoryIndex.next || !directoryIndex.nameHashes || !directoryIndex.freeSlots
+            || !directoryIndex.openSlots || !directoryIndex.openSlotFiles || !directoryItems
+            || !read_cache_blocks(directoryItems, superblock.directoryStart, superblock.numDirectoryBlocks)) {
+        free(directoryItems);
+        free(directoryIndex.buckets);
+        free(directoryIndex.next);
+        free(directoryIndex.nameHashes);
+        free(directoryIndex.freeSlots);
+        free(directoryIndex.openSlots);
+        free(directoryIndex.openSlotFiles);
+        bzero(&directoryIndex, sizeof(DirectoryIndex));
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < directoryIndex.numBuckets; i++)
+        directoryIndex.buckets[i] = -1;
+    directoryIndex.numFreeSlots = 0;
+    for (int slot = numSlots - 1; slot >= 0; slot--) {
+        if (directoryItems[slot].allocated)
+            indexDirectoryItem(slot, directoryItems[slot].name);
+        else
+            directoryIndex.freeSlots[directoryIndex.numFreeSlots++] = slot;
+    }
+    free(directoryItems);
+    threadBlocksRead += superblock.numDirectoryBlocks;
+    countPath(FS_PATH_DIRECTORY_SCAN, 0, numSlots);
+    directoryIndex.loaded = 1;
+    return 1;
+}
+
+//Creates a new directory item in the lowest free directory slot. Returns the slot, or -1 if the
+//directory is full. The caller holds the directory lock exclusively.
+int createDirectoryItem(DirectoryItem directory) {
+    if (directoryIndex.numFreeSlots == 0)
+        return -1;
+
+    int slot = directoryIndex.freeSlots[directoryIndex.numFreeSlots - 1];
+    if (!writeDirectoryItem(directory, slot)) {
+        fserror = FS_IO_ERROR;
+        return -1;
+    }
+    directoryIndex.numFreeSlots--;
+    indexDirectoryItem(slot, directory.name);
+    return slot;
+}
+
+//Clears the directory item in the given directory slot and returns the slot to the free list. The caller holds
+//the directory lock exclusively.
+int removeDirectoryItem(int slot) {
+    DirectoryItem empty;
+    int *link = &directoryIndex.buckets[directoryIndex.nameHashes[slot] & (directoryIndex.numBuckets - 1)];
+
+    bzero(&empty, sizeof(DirectoryItem));
+    if (!writeDirectoryItem(empty, slot))
+        return 0;
+    while (*link != -1) {
+        if (*link == slot) {
+            *link = directoryIndex.next[slot];
+            break;
+        }
+        link = &directoryIndex.next[*link];
+    }
+    directoryIndex.freeSlots[directoryIndex.numFreeSlots++] = slot;
+    return 1;
+}
+
+//Tells whether a file can have the given name: it isn't empty and fits in a directory item with its terminator.
+int isLegalName(char *name) {
+    return name && name[0] && strnlen(name, MAX_NAME_SIZE) < MAX_NAME_SIZE;
+}
+
+//Finds a directory given a directory name, and then reads the directory into the given directory pointer.
+//Only directory items whose name hashes the same are read. Returns the directory slot, or -1 if not found, with
+//fserror set to FS_ILLEGAL_FILENAME if no file can have the name. The caller holds the directory lock.
+int findDirectoryItem(DirectoryItem * directory, char* name) {
+    uint32_t hash;
+    unsigned long examined = 0;
+    int found = -1;
+
+    //A name too long for a directory item mustn't match the file whose name it starts with
+    if (!isLegalName(name)) {
+        fserror = FS_ILLEGAL_FILENAME;
+        return -1;
+    }
+    hash = hashName(name);
+
+    for (int slot = directoryIndex.buckets[hash & (directoryIndex.numBuckets - 1)]; slot != -1; slot = directoryIndex.next[slot]) {
+        examined++;
+        if (directoryIndex.nameHashes[slot] != hash)
+            continue;
+        if (!readDirectoryItem(directory, slot)) {
+            fserror=FS_IO_ERROR;
+            break;
+        }
+        if (directory->allocated && !strncmp(name, directory->name,MAX_NAME_SIZE - 1  )) {
+            found = slot;
+            break;
+        }
+    }
+
+    countPath(FS_PATH_DIRECTORY_SCAN, 1, examined);
+    return found;
+}
+
+
+//Finds how the given block of the file is mapped: its disk block, with UNWRITTEN_BLOCK set if the block was
+//preallocated and hasn't been written since, or 0 if it hasn't been allocated yet. Returns 0 on failure.
+int findInodeBlockMapping(unsigned int blockIndex, File file, uint32_t *mapping) {
+    if (blockIndex < NUM_DIRECTLY_MAPPED_INODE_BLOCKS) {
+        *mapping = file->inode.blocks[blockIndex];
+    }
+    else if (blockIndex >= MAX_FILE_BLOCKS) {
+        return 0;
+    }
+    else if (!file->inode.blocks[INDIRECT_BLOCK_SLOT] && !file->inode.blocks[DOUBLE_INDIRECT_BLOCK_SLOT]) {
+        *mapping = 0;
+    }
+    else if (!loadBlockMap(file)) {
+        return 0;
+    }
+    else {
+        countPath(FS_PATH_INDIRECT_LOOKUP, 1, 0);
+        blockIndex -= NUM_DIRECTLY_MAPPED_INODE_BLOCKS;
+        *mapping = file->mapBlocks[blockIndex / NUM_INDIRECT_BLOCK_MAPPINGS].blocks[blockIndex % NUM_INDIRECT_BLOCK_MAPPINGS];
+    }
+    return 1;
+}
+
+//Finds the disk block holding the given block of the file, or 0 if that block hasn't been allocated yet.
+int findInodeDataBlockIndex(unsigned int blockIndex, File file) {
+    uint32_t mapping;
+
+    if (!findInodeBlockMapping(blockIndex, file, &mapping))
+        return -1;
+    return mapping & ~UNWRITTEN_BLOCK;
+}
+
+//Allocates disk blocks for numBlocks unallocated blocks of the file starting at blockIndex, in one contiguous run
+//if the disk has one that long, and records them in the file's inode with the given flags. Returns how many blocks,
+//from blockIndex on, were allocated, or 0 on failure.
+unsigned int allocateDataBlocks(File file, unsigned int blockIndex, unsigned int numBlocks, uint32_t flags) {
+    unsigned int runLength, mapped;
+    int bit = allocateBitRun(&dataBitmap, numBlocks, &file->numAllocatingBlocks, &runLength);
+
+    if (bit < 0) {
+        if (fserror == FS_NONE)
+            fserror = FS_OUT_OF_SPACE;
+        return 0;
+    }
+    for (mapped = 0; mapped < runLength; mapped++) {
+        if (!setInodeDataBlock(blockIndex + mapped, (superblock.dataStart + bit + mapped) | flags, file))
+            break;
+    }
+    //Whatever couldn't be mapped goes back
+    for (unsigned int i = mapped; i < runLength; i++)
+        setDataBlockStatus(superblock.dataStart + bit + i, 0);
+    if (mapped == 0 && fserror == FS_NONE)
+        fserror = FS_IO_ERROR;
+    return mapped;
+}
+
+//Counts how many blocks of the file, starting at blockIndex and up to maxBlocks, sit in consecutive disk blocks
+//that are all written or all unwritten. A run of unallocated blocks counts as contiguous too. The mapping of the
+//first block of the run (0 for unallocated) is stored in mapping. Returns 0 on failure.
+unsigned int findContiguousBlocks(File file, unsigned int blockIndex, unsigned int maxBlocks, uint32_t *mapping) {
+    unsigned int numBlocks = 1;
+    uint32_t next;
+
+    if (!findInodeBlockMapping(blockIndex, file, mapping))
+        return 0;
+    while (numBlocks < maxBlocks) {
+        if (!findInodeBlockMapping(blockIndex + numBlocks, file, &next))
+            break;
+        if (*mapping == 0 ? next != 0 : next != *mapping + numBlocks)
+            break;
+        numBlocks++;
+    }
+    return numBlocks;
+}
+
+//Allocates room for the runs of contiguous disk blocks in numBlocks file blocks. A single block uses oneRun.
+CacheRun *allocateRuns(unsigned int numBlocks, CacheRun *oneRun) {
+    if (numBlocks == 1)
+        return oneRun;
+    return malloc(numBlocks * sizeof(CacheRun));
+}
+
+//Frees runs allocated by allocateRuns.
+void freeRuns(CacheRun *runs, CacheRun *oneRun) {
+    if (runs != oneRun)
+        free(runs);
+}
+
+//Tells whether the file holds the given block among its delayed blocks.
+int isDelayedBlock(File file, unsigned int blockIndex) {
+    return file->numDelayedBlocks > 0 && blockIndex >= file->delayedStart
+           && blockIndex < file->delayedStart + file->numDelayedBlocks;
+}
+
+//Tells whether a block of data is all zeros.
+int isZeroBlock(const unsigned char *data) {
+    return memcmp(data, zeroBlock, SOFTWARE_DISK_BLOCK_SIZE) == 0;
+}
+
+//Fills numBlocks unallocated blocks of the file, starting at blockIndex, from its delayed blocks, or with zeros where
+//it has none.
+void readDelayedBlocks(File file, unsigned char *data, unsigned int blockIndex, unsigned int numBlocks) {
+    for (unsigned int i = blockIndex; i < blockIndex + numBlocks; i++, data += SOFTWARE_DISK_BLOCK_SIZE) {
+        if (isDelayedBlock(file, i))
+            memcpy(data, file->delayedBlocks + (unsigned long)(i - file->delayedStart) * SOFTWARE_DISK_BLOCK_SIZE,
+                   SOFTWARE_DISK_BLOCK_SIZE);
+        else
+            bzero(data, SOFTWARE_DISK_BLOCK_SIZE);
+    }
+}
+
+//Adds a run to runs for every run of contiguous disk blocks in numBlocks blocks of the file, starting at blockIndex,
+//that are to be read into data. Unallocated blocks are filled from the file's delayed blocks or with zeros right
+//away, and unwritten blocks with zeros. Returns 0 on failure.
+int addFileRuns(File file, unsigned char *data, unsigned int blockIndex, unsigned int numBlocks, CacheRun *runs,
+                unsigned int *numRuns) {
+    unsigned int runBlocks;
+    uint32_t mapping;
+
+    while (numBlocks > 0) {
+        runBlocks = findContiguousBlocks(file, blockIndex, numBlocks, &mapping);
+        if (!runBlocks)
+            return 0;
+        if (mapping == 0)
+            readDelayedBlocks(file, data, blockIndex, runBlocks);
+        else if (mapping & UNWRITTEN_BLOCK)
+            bzero(data, (unsigned long)runBlocks * SOFTWARE_DISK_BLOCK_SIZE);
+        else {
+            runs[*numRuns].buf = data;
+            runs[*numRuns].blocknum = mapping;
+            runs[*numRuns].count = runBlocks;
+            (*numRuns)++;
+            threadBlocksRead += runBlocks;
+        }
+        data += runBlocks * SOFTWARE_DISK_BLOCK_SIZE;
+        blockIndex += runBlocks;
+        numBlocks -= runBlocks;
+    }
+    return 1;
+}
+
+//Reads numBlocks blocks of the file, starting at blockIndex, into data, and the numAhead blocks after them into
+//the file's read-ahead blocks. Unallocated blocks read as the file's delayed blocks or as zeros, unwritten blocks as
+//zeros, and every run of contiguous disk blocks is submitted together, so the reads overlap and are waited for once.
+int readFileBlocksAhead(File file, void *data, unsigned int blockIndex, unsigned int numBlocks, unsigned int numAhead) {
+    CacheRun oneRun, *runs = allocateRuns(numBlocks + numAhead, &oneRun);
+    unsigned int numRuns = 0;
+    int ret;
+
+    if (!runs) {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    ret = addFileRuns(file, data, blockIndex, numBlocks, runs, &numRuns)
+          && (numAhead == 0 || addFileRuns(file, file->readAheadBlocks, blockIndex + numBlocks, numAhead, runs, &numRuns))
+          && (numRuns == 0 || read_cache_runs(runs, numRuns));
+    freeRuns(runs, &oneRun);
+    if (!ret)
+        fserror = FS_IO_ERROR;
+    return ret;
+}
+
+//Reads numBlocks blocks of the file, starting at blockIndex, into data.
+int readFileBlocks(File file, void *data, unsigned int blockIndex, unsigned int numBlocks) {
+    return readFileBlocksAhead(file, data, blockIndex, numBlocks, 0);
+}
+
+//Reads numBlocks blocks of the file, starting at blockIndex, into data, copying whatever the file read ahead last
+//time. A read that carries on from the last one reads ahead too, twice as far as last time up to
+//MAX_READAHEAD_BLOCKS, but never past the end of the file. Any other read stops reading ahead.
+int readSequentialBlocks(File file, unsigned char *data, unsigned int blockIndex, unsigned int numBlocks, int sequential) {
+    unsigned int numCopied, numAhead = 0, fileBlocks;
+
+    if (file->numReadAheadBlocks > 0 && blockIndex >= file->readAheadStart
+            && blockIndex < file->readAheadStart + file->numReadAheadBlocks) {
+        numCopied = file->readAheadStart + file->numReadAheadBlocks - blockIndex;
+        if (numCopied > numBlocks)
+            numCopied = numBlocks;
+        memcpy(data, file->readAheadBlocks + (unsigned long)(blockIndex - file->readAheadStart) * SOFTWARE_DISK_BLOCK_SIZE,
+               (unsigned long)numCopied * SOFTWARE_DISK_BLOCK_SIZE);
+        data += (unsigned long)numCopied * SOFTWARE_DISK_BLOCK_SIZE;
+        blockIndex += numCopied;
+        numBlocks -= numCopied;
+    }
+    if (numBlocks == 0)
+        return 1;
+
+    if (!sequential)
+        file->readAheadWindow = 0;
+    else if (file->readAheadWindow == 0)
+        file->readAheadWindow = MIN_READAHEAD_BLOCKS;
+    else if (file->readAheadWindow < MAX_READAHEAD_BLOCKS)
+        file->readAheadWindow *= 2;
+    fileBlocks = (file->inode.fileSize + SOFTWARE_DISK_BLOCK_SIZE - 1) / SOFTWARE_DISK_BLOCK_SIZE;
+    if (blockIndex + numBlocks < fileBlocks)
+        numAhead = fileBlocks - (blockIndex + numBlocks);
+    if (numAhead > file->readAheadWindow)
+        numAhead = file->readAheadWindow;
+    if (numAhead > 0 && !file->readAheadBlocks) {
+        file->readAheadBlocks = malloc(MAX_READAHEAD_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE);
+        if (!file->readAheadBlocks)
+            numAhead = 0;
+    }
+
+    file->numReadAheadBlocks = 0;
+    if (!readFileBlocksAhead(file, data, blockIndex, numBlocks, numAhead))
+        return 0;
+    file->readAheadStart = blockIndex + numBlocks;
+    file->numReadAheadBlocks = numAhead;
+    return 1;
+}
+
+//Writes numBlocks blocks from data into the file, starting at blockIndex, allocating any blocks the file doesn't
+//have yet, except those that are all zeros, which stay holes. Every run of contiguous disk blocks is submitted
+//together and waited for once, and unwritten blocks count as written once their data is. Returns the number of
+//blocks written, which is less than numBlocks if the disk fills up, or 0 if writing fails.
+unsigned int writeFileBlocks(File file, void *data, unsigned int blockIndex, unsigned int numBlocks) {
+    CacheRun oneRun, *runs;
+    unsigned int allocatedBlocks = 0, written = 0, numRuns = 0, runBlocks, numDiskBlocks = 0;
+    int dataBlockIndex, unwritten = 0;
+    uint32_t mapping;
+
+    while (allocatedBlocks < numBlocks) {
+        dataBlockIndex = findInodeDataBlockIndex(blockIndex + allocatedBlocks, file);
+        if (dataBlockIndex < 0)
+            break;
+        if (dataBlockIndex > 0 || isZeroBlock(data + (unsigned long)allocatedBlocks * SOFTWARE_DISK_BLOCK_SIZE)) {
+            allocatedBlocks++;
+            continue;
+        }
+        //Unallocated blocks in a row are given one run of disk blocks
+        runBlocks = 1;
+        while (allocatedBlocks + runBlocks < numBlocks
+                && findInodeDataBlockIndex(blockIndex + allocatedBlocks + runBlocks, file) == 0
+                && !isZeroBlock(data + (unsigned long)(allocatedBlocks + runBlocks) * SOFTWARE_DISK_BLOCK_SIZE))
+            runBlocks++;
+        runBlocks = allocateDataBlocks(file, blockIndex + allocatedBlocks, runBlocks, 0);
+        if (!runBlocks)
+            break;
+        allocatedBlocks += runBlocks;
+    }
+    if (allocatedBlocks == 0)
+        return 0;
+
+    runs = allocateRuns(allocatedBlocks, &oneRun);
+    if (!runs) {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    while (written < allocatedBlocks) {
+        runBlocks = findContiguousBlocks(file, blockIndex + written, allocatedBlocks - written, &mapping);
+        if (!runBlocks)
+            break;
+        if (mapping & UNWRITTEN_BLOCK)
+            unwritten = 1;
+        //Holes are left as they are
+        if (mapping != 0) {
+            runs[numRuns].buf = data;
+            runs[numRuns].blocknum = mapping & ~UNWRITTEN_BLOCK;
+            runs[numRuns].count = runBlocks;
+            numRuns++;
+            numDiskBlocks += runBlocks;
+        }
+        data += runBlocks * SOFTWARE_DISK_BLOCK_SIZE;
+        written += runBlocks;
+    }
+    if (written < allocatedBlocks || (numRuns > 0 && !write_cache_runs(runs, numRuns))) {
+        fserror = FS_IO_ERROR;
+        written = 0;
+    }
+    threadBlocksWritten += numDiskBlocks;
+    freeRuns(runs, &oneRun);
+    //The journal writes the cleared flags after the data they now point to
+    for (unsigned int i = 0; unwritten && i < written; i++) {
+        if (findInodeBlockMapping(blockIndex + i, file, &mapping) && (mapping & UNWRITTEN_BLOCK)
+                && !setInodeDataBlock(blockIndex + i, mapping & ~UNWRITTEN_BLOCK, file))
+            return 0;
+    }
+    return written;
+}
+
+//Counts how many blocks of the file, starting at blockIndex and up to maxBlocks, already have disk blocks.
+unsigned int countAllocatedBlocks(File file, unsigned int blockIndex, unsigned int maxBlocks) {
+    unsigned int numBlocks = 0;
+    while (numBlocks < maxBlocks && findInodeDataBlockIndex(blockIndex + numBlocks, file) > 0)
+        numBlocks++;
+    return numBlocks;
+}
+
+//Data blocks to set aside for a delayed block of the file: the block itself, plus the indirect block and the double
+//indirect block that may have to be allocated to map it, counted once for each run of delayed blocks.
+unsigned int delayedBlockReservation(File file, unsigned int blockIndex) {
+    unsigned int numBlocks = 1, first = file->numDelayedBlocks == 0;
+
+    if (blockIndex >= NUM_DIRECTLY_MAPPED_INODE_BLOCKS
+            && (first || (blockIndex - NUM_DIRECTLY_MAPPED_INODE_BLOCKS) % NUM_INDIRECT_BLOCK_MAPPINGS == 0))
+        numBlocks++;
+    if (blockIndex >= NUM_DIRECTLY_MAPPED_INODE_BLOCKS + NUM_INDIRECT_BLOCK_MAPPINGS
+            && (first || blockIndex == NUM_DIRECTLY_MAPPED_INODE_BLOCKS + NUM_INDIRECT_BLOCK_MAPPINGS))
+        numBlocks++;
+    return numBlocks;
+}
+
+//Gives the file's delayed blocks disk blocks, one contiguous run if the disk has one that long, and writes them.
+//The blocks are taken out of the space set aside for them, and whatever they didn't need is given back after. The
+//caller holds the file's lock and has a transaction handle.
+int flushDelayedBlocks(File file) {
+    unsigned int numBlocks = file->numDelayedBlocks, written;
+
+    if (numBlocks == 0)
+        return 1;
+    file->numAllocatingBlocks = file->numReservedBlocks;
+    file->numReservedBlocks = 0;
+    file->numDelayedBlocks = 0;
+    written = writeFileBlocks(file, file->delayedBlocks, file->delayedStart, numBlocks);
+    releaseBits(&dataBitmap, file->numAllocatingBlocks);
+    file->numAllocatingBlocks = 0;
+    if (written < numBlocks) {
+        if (fserror == FS_NONE)
+            fserror = FS_OUT_OF_SPACE;
+        return 0;
+    }
+    return 1;
+}
+
+//Finds where the given unallocated block of the file is held until it gets a disk block. A new delayed block reads
+//as zeros. It has to follow on from the ones the file already holds, which are written out first if it doesn't or
+//if there's no room for more. Returns NULL if the disk can't spare a block for it, or on failure.
+unsigned char *findDelayedBlock(File file, unsigned int blockIndex) {
+    unsigned char *block;
+    unsigned int numReserved;
+
+    if (isDelayedBlock(file, blockIndex))
+        return file->delayedBlocks + (unsigned long)(blockIndex - file->delayedStart) * SOFTWARE_DISK_BLOCK_SIZE;
+    if (file->numDelayedBlocks > 0 && (blockIndex != file->delayedStart + file->numDelayedBlocks
+                                       || file->numDelayedBlocks == DELAYED_ALLOCATION_BLOCKS)) {
+        if (!flushDelayedBlocks(file))
+            return NULL;
+    }
+    if (!file->delayedBlocks) {
+        file->delayedBlocks = malloc(DELAYED_ALLOCATION_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE);
+        if (!file->delayedBlocks)
+            return NULL;
+    }
+    numReserved = delayedBlockReservation(file, blockIndex);
+    if (!reserveBits(&dataBitmap, numReserved))
+        return NULL;
+    if (file->numDelayedBlocks == 0)
+        file->delayedStart = blockIndex;
+    file->numReservedBlocks += numReserved;
+    block = file->delayedBlocks + (unsigned long)file->numDelayedBlocks++ * SOFTWARE_DISK_BLOCK_SIZE;
+    bzero(block, SOFTWARE_DISK_BLOCK_SIZE);
+    return block;
+}
+
+//Tells whether the file keeps its data in its inode.
+int isInlineFile(File file) {
+    return file->inode.flags & INODE_INLINE_DATA;
+}
+
+//Moves the data a file keeps in its inode to a delayed block, so the file maps data blocks like any other from then
+//on. The caller holds the file's lock and has a transaction handle.
+int spillInlineData(File file) {
+    unsigned char data[MAX_INLINE_BYTES];
+    unsigned char *block;
+
+    if (!isInlineFile(file))
+        return 1;
+    memcpy(data, file->inode.blocks, MAX_INLINE_BYTES);
+    bzero(file->inode.blocks, MAX_INLINE_BYTES);
+    file->inode.flags &= ~INODE_INLINE_DATA;
+    file->inodeDirty = 1;
+    if (file->inode.fileSize == 0)
+        return 1;
+    block = findDelayedBlock(file, 0);
+    if (!block) {
+        memcpy(file->inode.blocks, data, MAX_INLINE_BYTES);
+        file->inode.flags |= INODE_INLINE_DATA;
+        if (fserror == FS_NONE)
+            fserror = FS_OUT_OF_SPACE;
+        return 0;
+    }
+    memcpy(block, data, MAX_INLINE_BYTES);
+    return 1;
+}
+
+//Writes what the file changed in memory, its indirect blocks, its inode and the bitmaps, through the journal. The
+//caller holds the file's lock and has a transaction handle.
+int writeBackFile(File file) {
+    if (!writeBackBlockMap(file))
+        return 0;
+    if (file->inodeDirty) {
+        if (!writeInode(file->directory.inodeIndex, file->inode))
+            return 0;
+        file->inodeDirty = 0;
+    }
+    file->blocksMapped = 0;
+    return writeBackMetadata();
+}
+
+//Most metadata blocks writing the file back changes: those of an operation mapping its delayed blocks, and the
+//indirect blocks it has changed already, but never more than for mapping a whole file. The caller holds the file's
+//lock.
+unsigned int writeBackBlocks(File file) {
+    unsigned int numBlocks = operationBlocks(file->numDelayedBlocks) + file->doubleIndirectBlockDirty;
+
+    for (unsigned int i = 0; file->mapBlocks && i < NUM_MAP_BLOCKS; i++)
+        numBlocks += file->mapBlockDirty[i];
+    if (numBlocks > operationBlocks(MAX_FILE_BLOCKS))
+        numBlocks = operationBlocks(MAX_FILE_BLOCKS);
+    return numBlocks;
+}
+
+//Opens a transaction handle with room to write the file back and takes the file's lock, going round again if the
+//file needs more room by the time it is locked. Returns the number of blocks the handle is for, or 0 without the
+//lock if no transaction could be started.
+unsigned int startFileWriteBack(File file) {
+    unsigned int numBlocks;
+
+    for (;;) {
+        pthread_mutex_lock(&file->lock);
+        numBlocks = writeBackBlocks(file);
+        pthread_mutex_unlock(&file->lock);
+        if (!startTransaction(numBlocks))
+            return 0;
+        pthread_mutex_lock(&file->lock);
+        if (writeBackBlocks(file) <= numBlocks)
+            return numBlocks;
+        pthread_mutex_unlock(&file->lock);
+        endTransaction(numBlocks);
+    }
+}
+
+//Adds a file to the list of open files.
+void addOpenFile(File file) {
+    pthread_mutex_lock(&openFilesLock);
+    file->nextOpenFile = openFiles;
+    openFiles = file;
+    pthread_mutex_unlock(&openFilesLock);
+}
+
+//Takes a file off the list of open files. Returns 0 if it isn't on the list, having been closed already.
+int removeOpenFile(File file) {
+    int found = 0;
+
+    pthread_mutex_lock(&openFilesLock);
+    File *link = &openFiles;
+    while (*link) {
+        if (*link == file) {
+            *link = file->nextOpenFile;
+            file->nextOpenFile = NULL;
+            found = 1;
+            break;
+        }
+        link = &(*link)->nextOpenFile;
+    }
+    pthread_mutex_unlock(&openFilesLock);
+    return found;
+}
+
+//Makes the handle user code is given for an open file. A handle isn't the address of the file's FileInternals but
+//its directory slot and the generation it was opened with, so a handle that has been closed is told apart from the
+//one the slot is open with now, and a closed file can be freed.
+_Static_assert(sizeof(uintptr_t) >= 8, "handles hold a directory slot and a generation");
+File fileHandle(File file) {
+    if (!file)
+        return NULL;
+    return (File)((uintptr_t)file->generation << 32 | file->directorySlot);
+}
+
+//Finds the open file a handle made by fileHandle refers to. Returns NULL if it has been closed.
+File findOpenFile(File handle) {
+    unsigned int slot = (uint32_t)(uintptr_t)handle;
+    uint32_t generation = (uintptr_t)handle >> 32;
+
+    if (!handle || !__atomic_load_n(&mounted, __ATOMIC_ACQUIRE) || slot >= superblock.numDirectoryItems
+            || __atomic_load_n(&directoryIndex.openSlots[slot], __ATOMIC_ACQUIRE) != generation)
+        return NULL;
+    return __atomic_load_n(&directoryIndex.openSlotFiles[slot], __ATOMIC_ACQUIRE);
+}
+
+int fs_format(unsigned long numinodes, unsigned long numdirectoryitems, unsigned long maxfilesize) {
+    Superblock layout;
+    SuperblockBlock block;
+    unsigned char *zeros;
+
+    fserror = FS_NONE;
+    if (maxfilesize == 0)
+        maxfilesize = MAX_FILE_BYTES;
+    if (!computeLayout(&layout, software_disk_size(), numinodes, numdirectoryitems, maxfilesize)) {
+        fserror = FS_OUT_OF_SPACE;
+        return 0;
+    }
+    unmountFilesystem();
+
+    //Zeroes the journal, the bitmaps, the inode table and the directory, then writes the superblock last
+    zeros = calloc(FORMAT_CHUNK_BLOCKS, SOFTWARE_DISK_BLOCK_SIZE);
+    if (!zeros) {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    for (uint32_t blockIndex = SUPERBLOCK_INDEX + 1; blockIndex < layout.dataStart; blockIndex += FORMAT_CHUNK_BLOCKS) {
+        uint32_t numBlocks = layout.dataStart - blockIndex;
+        if (numBlocks > FORMAT_CHUNK_BLOCKS)
+            numBlocks = FORMAT_CHUNK_BLOCKS;
+        if (!write_cache_blocks(zeros, blockIndex, numBlocks)) {
+            free(zeros);
+            fserror = FS_IO_ERROR;
+            return 0;
+        }
+    }
+    free(zeros);
+    if (!writeJournalHeader(layout.journalStart, 1)) {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+
+    bzero(&block, sizeof(SuperblockBlock));
+    block.superblock = layout;
+    if (!write_cache_block(&block, SUPERBLOCK_INDEX) || !flush_block_cache()) {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    return 1;
+}
+
+//Gives a new file an inode, written from the given one, and a directory item. Returns its directory slot, or -1
+//with fserror set. The caller holds the directory lock exclusively, so two threads can't create the same name, and
+//has a transaction handle.
+int addFile(char *name, Inode *inode, DirectoryItem *directory) {
+    DirectoryItem existing;
+    int inodeIndex, slot = -1;
+
+    if (!isLegalName(name)) {
+        fserror=FS_ILLEGAL_FILENAME;
+        return -1;
+    }
+    if (findDirectoryItem(&existing, name) >= 0) {
+        fserror=FS_FILE_ALREADY_EXISTS;
+        return -1;
+    }
+    if (fserror != FS_NONE)
+        return -1;
+
+    inodeIndex = allocateInodeIndex();
+    if (inodeIndex < 0) {
+        if (fserror == FS_NONE)
+            fserror=FS_OUT_OF_SPACE;
+        return -1;
+    }
+    bzero(directory, sizeof(DirectoryItem));
+    directory->inodeIndex = inodeIndex;
+    directory->allocated = 1;
+    strncpy(directory->name, name, MAX_NAME_SIZE - 1);
+    if (!writeInode(inodeIndex, *inode)) {
+        fserror=FS_IO_ERROR;
+    }
+    else {
+        slot = createDirectoryItem(*directory);
+        if (slot < 0 && fserror == FS_NONE)
+            fserror=FS_OUT_OF_SPACE;
+    }
+    if (slot < 0)
+        setInodeStatus(inodeIndex, 0);
+    return slot;
+}
+
+File createFile(char *name) {
+    int slot;
+    fserror=FS_NONE;
+    if (!mountFilesystem())
+        return 0;
+    if (!isLegalName(name)) {
+        fserror=FS_ILLEGAL_FILENAME;
+        return 0;
+    }
+    //The inode, its bit in the bitmap and the directory item are committed together
+    if (!startTransaction(operationBlocks(0)))
+        return 0;
+
+    File file = (File) malloc(sizeof(FileInternals));
+    bzero(file, sizeof(FileInternals));
+    file->fileMode = READ_WRITE;
+    pthread_mutex_init(&file->lock, NULL);
+
+    file->position=0;
+    //New files keep their data in the inode until it outgrows it
+    file->inode.flags = INODE_INLINE_DATA;
+
+    pthread_rwlock_wrlock(&directoryLock);
+    slot = addFile(name, &file->inode, &file->directory);
+    //Marked open before the directory lock is let go, so the new file can't be deleted from under the handle
+    if (slot >= 0) {
+        openSlot(slot, file);
+        file->directory.open = 1;
+    }
+    pthread_rwlock_unlock(&directoryLock);
+    if (slot >= 0 && !writeBackMetadata())
+        fserror = FS_IO_ERROR;
+    endTransaction(operationBlocks(0));
+    if (slot < 0) {
+        pthread_mutex_destroy(&file->lock);
+        free(file);
+        return 0;
+    }
+    file->directorySlot = slot;
+    addOpenFile(file);
+    return file;
+}
+
+unsigned long writeFile(File file, void *buf, unsigned long numbytes) {
+    fserror=FS_NONE;
+    unsigned long bytesWritten = 0;
+    unsigned int numMetadataBlocks = operationBlocks(numbytes / SOFTWARE_DISK_BLOCK_SIZE + 2 + DELAYED_ALLOCATION_BLOCKS);
+    if (!file) {
+        fserror = FS_FILE_NOT_OPEN;
+        return 0;
+    }
+    reclaimFreedBlocks(numbytes / SOFTWARE_DISK_BLOCK_SIZE + 2);
+    //The new block mappings, the size and the allocations are committed together
+    if (!startTransaction(numMetadataBlocks))
+        return 0;
+
+    pthread_mutex_lock(&file->lock);
+    if (!file->directory.open) {
+        fserror=FS_FILE_NOT_OPEN;
+    }
+    else if (file->position + numbytes > superblock.maxFileSize) {
+        fserror = FS_OUT_OF_SPACE;
+    }
+    else if (file->fileMode == READ_ONLY) {
+        fserror = FS_FILE_READ_ONLY;
+    }
+    else {
+        unsigned char bytes[SOFTWARE_DISK_BLOCK_SIZE];
+        //Read-ahead blocks the write lands on would go stale
+        if (numbytes > 0 && file->numReadAheadBlocks > 0
+                && file->position / SOFTWARE_DISK_BLOCK_SIZE < file->readAheadStart + file->numReadAheadBlocks
+                && (file->position + numbytes - 1) / SOFTWARE_DISK_BLOCK_SIZE >= file->readAheadStart)
+            file->numReadAheadBlocks = 0;
+        if (isInlineFile(file) && file->position + numbytes <= MAX_INLINE_BYTES) {
+            //Small enough to stay in the inode, so no data block is touched
+            memcpy((unsigned char *)file->inode.blocks + file->position, buf, numbytes);
+            bytesWritten = numbytes;
+            file->position += numbytes;
+            if (numbytes > 0) file->inodeDirty = 1;
+            numbytes = 0;
+        }
+        else if (!spillInlineData(file))
+            numbytes = 0;
+        while (numbytes > 0) {
+            unsigned int blockIndex = file->position / SOFTWARE_DISK_BLOCK_SIZE;
+            unsigned int offset = file->position % SOFTWARE_DISK_BLOCK_SIZE;
+            int dataBlockIndex = findInodeDataBlockIndex(blockIndex, file);
+            unsigned char *delayedBlock = NULL;
+            unsigned long bytesToCopy;
+
+            if (dataBlockIndex < 0)
+                break;
+            if (dataBlockIndex == 0 && offset == 0 && numbytes >= DELAYED_ALLOCATION_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE) {
+                //A write this big gets its disk blocks right away, after the delayed blocks so they stay in order
+                if (!flushDelayedBlocks(file))
+                    break;
+            }
+            else if (dataBlockIndex == 0)
+                delayedBlock = findDelayedBlock(file, blockIndex);
+
+            if (delayedBlock) {
+                //New data waits in the handle and gets disk blocks when the delayed blocks are written out
+                if (SOFTWARE_DISK_BLOCK_SIZE - offset > numbytes)
+                    bytesToCopy = numbytes;
+                else
+                    bytesToCopy = SOFTWARE_DISK_BLOCK_SIZE - offset;
+                memcpy(delayedBlock + offset, buf + bytesWritten, bytesToCopy);
+            }
+            else if (offset == 0 && numbytes >= SOFTWARE_DISK_BLOCK_SIZE) {
+                //Whole aligned blocks are written straight from the caller's buffer, without reading them first.
+                //Blocks that already have disk blocks are overwritten up to the first one that doesn't.
+                unsigned int numBlocks = numbytes / SOFTWARE_DISK_BLOCK_SIZE;
+                if (dataBlockIndex > 0)
+                    numBlocks = countAllocatedBlocks(file, blockIndex, numBlocks);
+                unsigned int blocksWritten = writeFileBlocks(file, buf + bytesWritten, blockIndex, numBlocks);
+                bytesToCopy = (unsigned long)blocksWritten * SOFTWARE_DISK_BLOCK_SIZE;
+                if (blocksWritten < numBlocks) {
+                    if (fserror == FS_NONE)
+                        fserror = FS_OUT_OF_SPACE;
+                    numbytes = bytesToCopy;
+                }
+            }
+            else {
+                //A partial block at the head or tail of the write is read, patched and written back
+                if (SOFTWARE_DISK_BLOCK_SIZE - offset > numbytes)
+                    bytesToCopy = numbytes;
+                else
+                    bytesToCopy = SOFTWARE_DISK_BLOCK_SIZE - offset;
+                if (!readFileBlocks(file, bytes, blockIndex, 1))
+                    break;
+                memcpy(bytes + offset, buf + bytesWritten, bytesToCopy);
+                if (!writeFileBlocks(file, bytes, blockIndex, 1)) {
+                    if (fserror == FS_NONE)
+                        fserror = FS_OUT_OF_SPACE;
+                    break;
+                }
+            }
+
+            numbytes -= bytesToCopy;
+            bytesWritten += bytesToCopy;
+            file->position += bytesToCopy;
+        }
+
+        if (file->position > file->inode.fileSize) {
+            file->inode.fileSize = file->position;
+            file->inodeDirty = 1;
+        }
+        //While the file holds delayed blocks its metadata waits for them, so the inode never maps past what's on disk.
+        //Blocks the write did give disk blocks to are in this transaction's bitmaps, so their mappings have to be
+        //too: the delayed blocks are written out with them.
+        if (file->blocksMapped && !flushDelayedBlocks(file) && fserror == FS_NONE)
+            fserror = FS_IO_ERROR;
+        if (file->inodeDirty && file->numDelayedBlocks == 0 && !writeBackFile(file))
+            fserror = FS_IO_ERROR;
+    }
+    pthread_mutex_unlock(&file->lock);
+    endTransaction(numMetadataBlocks);
+
+    return bytesWritten;
+}
+
+unsigned long readFile(File file, void *buf, unsigned long numbytes) {
+    unsigned char *bytes;
+    unsigned long bytesRead = 0;
+
+    fserror=FS_NONE;
+    if (!file) {
+        fserror=FS_FILE_NOT_OPEN;
+        return 0;
+    }
+
+    pthread_mutex_lock(&file->lock);
+    if (file->directory.open == 0)
+        fserror=FS_FILE_NOT_OPEN;
+    else {
+        if (file->position >= file->inode.fileSize)
+            numbytes = 0;
+        else if (file->position + numbytes > file->inode.fileSize)
+            numbytes = file->inode.fileSize - file->position;
+
+        if (numbytes > 0 && isInlineFile(file)) {
+            memcpy(buf, (unsigned char *)file->inode.blocks + file->position, numbytes);
+            file->position += numbytes;
+            bytesRead = numbytes;
+        }
+        else if (numbytes > 0) {
+            unsigned int firstBlock = file->position / SOFTWARE_DISK_BLOCK_SIZE;
+            unsigned int numBlocks = (file->position + numbytes - 1) / SOFTWARE_DISK_BLOCK_SIZE - firstBlock + 1;
+
+            bytes = malloc((unsigned long)numBlocks * SOFTWARE_DISK_BLOCK_SIZE);
+            if (!bytes)
+                fserror=FS_IO_ERROR;
+            else {
+                if (readSequentialBlocks(file, bytes, firstBlock, numBlocks, file->position == file->nextReadPosition)) {
+                    memcpy(buf, bytes + file->position % SOFTWARE_DISK_BLOCK_SIZE, numbytes);
+                    file->position += numbytes;
+                    file->nextReadPosition = file->position;
+                    bytesRead = numbytes;
+                }
+                free(bytes);
+            }
+        }
+    }
+    pthread_mutex_unlock(&file->lock);
+
+    return bytesRead;
+}
+
+//Reads the disk blocks behind numBlocks blocks of the file, starting at blockIndex and stopping at the end of the
+//file, into the block cache, one request for each run of contiguous disk blocks. Blocks without data are skipped.
+void prefetchFileBlocks(File file, unsigned int blockIndex, unsigned int numBlocks) {
+    unsigned int fileBlocks = (file->inode.fileSize + SOFTWARE_DISK_BLOCK_SIZE - 1) / SOFTWARE_DISK_BLOCK_SIZE;
+    unsigned int runBlocks;
+    uint32_t mapping;
+
+    if (blockIndex + numBlocks > fileBlocks)
+        numBlocks = fileBlocks > blockIndex ? fileBlocks - blockIndex : 0;
+    while (numBlocks > 0) {
+        runBlocks = findContiguousBlocks(file, blockIndex, numBlocks, &mapping);
+        if (!runBlocks)
+            return;
+        if (mapping != 0 && !(mapping & UNWRITTEN_BLOCK))
+            prefetch_cache_blocks(mapping, runBlocks);
+        blockIndex += runBlocks;
+        numBlocks -= runBlocks;
+    }
+}
+
+unsigned long viewFile(File file, FileView *view, unsigned long numbytes) {
+    unsigned long bytesViewed = 0;
+
+    fserror = FS_NONE;
+    bzero(view, sizeof(FileView));
+    if (!file) {
+        fserror = FS_FILE_NOT_OPEN;
+        return 0;
+    }
 
-    int directory = findDirectoryItem(&file->directory, name);
-    if (directory < 0) {
-        fserror=FS_FILE_NOT_FOUND;
-        return 0;
+    pthread_mutex_lock(&file->lock);
+    if (file->directory.open == 0)
+        fserror = FS_FILE_NOT_OPEN;
+    else if (file->position < file->inode.fileSize && numbytes > 0) {
+        unsigned int blockIndex = file->position / SOFTWARE_DISK_BLOCK_SIZE;
+        unsigned int offset = file->position % SOFTWARE_DISK_BLOCK_SIZE;
+        uint32_t mapping;
+
+        bytesViewed = SOFTWARE_DISK_BLOCK_SIZE - offset;
+        if (bytesViewed > numbytes)
+            bytesViewed = numbytes;
+        if (bytesViewed > file->inode.fileSize - file->position)
+            bytesViewed = file->inode.fileSize - file->position;
+
+        if (isInlineFile(file)) {
+            //The inode can change once the file's lock is dropped, so the view gets its own copy
+            memcpy(view->copy, file->inode.blocks, MAX_INLINE_BYTES);
+            view->data = view->copy + offset;
+        }
+        else if (!findInodeBlockMapping(blockIndex, file, &mapping)) {
+            fserror = FS_IO_ERROR;
+            bytesViewed = 0;
+        }
+        else if (isDelayedBlock(file, blockIndex)) {
+            //A delayed block only lives in the handle until it is written out, so the view gets its own copy
+            readDelayedBlocks(file, view->copy, blockIndex, 1);
+            view->data = view->copy + offset;
+        }
+        else if (mapping == 0 || (mapping & UNWRITTEN_BLOCK))
+            view->data = zeroBlock + offset;
+        else {
+            //A view that carries on from the last read or view fetches the blocks after it into the cache as well,
+            //in a window that grows like read ahead
+            if (file->position != file->nextReadPosition) {
+                file->readAheadWindow = 0;
+                file->prefetchEnd = 0;
+            }
+            else if (blockIndex >= file->prefetchEnd) {
+                if (file->readAheadWindow == 0)
+                    file->readAheadWindow = MIN_READAHEAD_BLOCKS;
+                else if (file->readAheadWindow < MAX_READAHEAD_BLOCKS)
+                    file->readAheadWindow *= 2;
+                prefetchFileBlocks(file, blockIndex, file->readAheadWindow);
+                file->prefetchEnd = blockIndex + file->readAheadWindow;
+            }
+            const unsigned char *block = pin_cache_block(mapping);
+            threadBlocksRead++;
+            if (!block) {
+                fserror = FS_IO_ERROR;
+                bytesViewed = 0;
+            }
+            else {
+                view->data = block + offset;
+                view->blocknum = mapping;
+            }
+        }
+        if (bytesViewed > 0) {
+            view->length = bytesViewed;
+            file->position += bytesViewed;
+            file->nextReadPosition = file->position;
+        }
     }
+    pthread_mutex_unlock(&file->lock);
 
+    return bytesViewed;
+}
+
+void release_view(FileView *view) {
+    if (view->blocknum)
+        unpin_cache_block(view->blocknum);
+    bzero(view, sizeof(FileView));
+}
+
+int seekFile(File file, unsigned long bytepos) {
+    int ret = 1;
+
+    fserror = FS_NONE;
+    if (!file) {
+        fserror=FS_FILE_NOT_OPEN;
+        return 0;
+    }
     else {
-        file->directoryItemBlockIndex = directory;
-        if (file->directory.open) {
-            fserror = FS_FILE_OPEN;
+        if (bytepos >= superblock.maxFileSize) {
+            fserror=FS_EXCEEDS_MAX_FILE_SIZE;
             return 0;
         }
         else {
-            file->directory.open = 1;
-            if (!writeDirectoryItem(file->directory, file->directoryItemBlockIndex)) {
-                fserror=FS_IO_ERROR;
+            if (!startTransaction(operationBlocks(0)))
                 return 0;
+            pthread_mutex_lock(&file->lock);
+            if (!file->directory.open) {
+                fserror = FS_FILE_NOT_OPEN;
+                ret = 0;
             }
             else {
-                InodeBlock inodeBlock;
-                unsigned short int inodeBlockIndex = file->directory.inodeIndex / INODES_PER_INODE_BLOCK + FIRST_INODE_BLOCK_INDEX;
-                bzero(&file->inode, sizeof(Inode));
-
-                if (inodeBlockIndex > LAST_INODE_BLOCK_INDEX) {
-                    fserror = FS_OUT_OF_SPACE;
-                    return 0;
-                }
-                else {
-                    if (read_sd_block(&inodeBlock, inodeBlockIndex)) {
-                        file->inode=inodeBlock.inodes[file->directory.inodeIndex % INODES_PER_INODE_BLOCK];
-                    }
+                file->position = bytepos;
+                if (file->position > file->inode.fileSize) {
+                    //A file that outgrows its inode gets its data a block, leaving the rest a hole
+                    if (bytepos > MAX_INLINE_BYTES && !spillInlineData(file))
+                        ret = 0;
                     else {
-                        return 0;
-                        fserror=FS_IO_ERROR;
+                        file->inode.fileSize = bytepos;
+                        file->inodeDirty = 1;
+                        if (file->numDelayedBlocks == 0)
+                            ret = writeBackFile(file);
                     }
                 }
             }
+            pthread_mutex_unlock(&file->lock);
+            endTransaction(operationBlocks(0));
         }
     }
 
+    return ret;
+}
+
+//Tells whether the given block of the file holds data, on disk or among its delayed blocks, rather than being a hole
+//or unwritten. Returns -1 on failure.
+int isDataBlock(File file, unsigned int blockIndex) {
+    uint32_t mapping;
+
+    if (!findInodeBlockMapping(blockIndex, file, &mapping)) {
+        fserror = FS_IO_ERROR;
+        return -1;
+    }
+    if (mapping == 0)
+        return isDelayedBlock(file, blockIndex);
+    return !(mapping & UNWRITTEN_BLOCK);
+}
+
+int fileRegion(File file, unsigned long bytepos, unsigned long *length) {
+    unsigned int blockIndex, lastBlock;
+    unsigned long end;
+    int data = 0, next = 0;
+
     fserror = FS_NONE;
-    return file;
+    *length = 0;
+    if (!file) {
+        fserror = FS_FILE_NOT_OPEN;
+        return -1;
+    }
+
+    pthread_mutex_lock(&file->lock);
+    if (!file->directory.open) {
+        fserror = FS_FILE_NOT_OPEN;
+        data = -1;
+    }
+    else if (bytepos < file->inode.fileSize && isInlineFile(file)) {
+        data = 1;
+        *length = file->inode.fileSize - bytepos;
+    }
+    else if (bytepos < file->inode.fileSize) {
+        blockIndex = bytepos / SOFTWARE_DISK_BLOCK_SIZE;
+        lastBlock = (file->inode.fileSize - 1) / SOFTWARE_DISK_BLOCK_SIZE;
+        data = isDataBlock(file, blockIndex);
+        while (data >= 0 && blockIndex < lastBlock && (next = isDataBlock(file, blockIndex + 1)) == data)
+            blockIndex++;
+        if (next < 0)
+            data = -1;
+        if (data >= 0) {
+            end = (unsigned long)(blockIndex + 1) * SOFTWARE_DISK_BLOCK_SIZE;
+            if (end > file->inode.fileSize)
+                end = file->inode.fileSize;
+            *length = end - bytepos;
+        }
+    }
+    pthread_mutex_unlock(&file->lock);
+    return data;
 }
 
-void close_file(File file) {
+int preallocateFile(File file, unsigned long numbytes) {
+    unsigned int numBlocks = (numbytes + SOFTWARE_DISK_BLOCK_SIZE - 1) / SOFTWARE_DISK_BLOCK_SIZE;
+    //Room for the indirect blocks of the new blocks and of the delayed blocks written out first
+    unsigned int numMetadataBlocks = operationBlocks(numBlocks + 2 * DELAYED_ALLOCATION_BLOCKS + 2);
+    unsigned int numUnallocated = 0, runBlocks;
+    uint32_t mapping;
+
+    fserror = FS_NONE;
+    if (!file) {
+        fserror = FS_FILE_NOT_OPEN;
+        return 0;
+    }
+    if (numbytes > superblock.maxFileSize) {
+        fserror = FS_EXCEEDS_MAX_FILE_SIZE;
+        return 0;
+    }
+    reclaimFreedBlocks(numBlocks);
+    //The new mappings and their bits in the bitmap are committed together
+    if (!startTransaction(numMetadataBlocks))
+        return 0;
+    pthread_mutex_lock(&file->lock);
+    if (!file->directory.open)
+        fserror = FS_FILE_NOT_OPEN;
+    else if (file->fileMode == READ_ONLY)
+        fserror = FS_FILE_READ_ONLY;
+    //Data that fits in the inode needs no blocks
+    else if ((!isInlineFile(file) || numbytes > MAX_INLINE_BYTES) && spillInlineData(file) && flushDelayedBlocks(file)) {
+        //The disk has to have room for every missing block and indirect block before any is allocated
+        for (unsigned int i = 0; i < numBlocks && fserror == FS_NONE; i++) {
+            if (!findInodeBlockMapping(i, file, &mapping))
+                fserror = FS_IO_ERROR;
+            else if (mapping == 0)
+                numUnallocated++;
+        }
+        if (numUnallocated > 0 && numBlocks > NUM_DIRECTLY_MAPPED_INODE_BLOCKS) {
+            unsigned int lastMapBlock = (numBlocks - 1 - NUM_DIRECTLY_MAPPED_INODE_BLOCKS) / NUM_INDIRECT_BLOCK_MAPPINGS;
+            if (lastMapBlock > 0 && !file->inode.blocks[DOUBLE_INDIRECT_BLOCK_SLOT])
+                numUnallocated++;
+            for (unsigned int i = 0; i <= lastMapBlock; i++)
+                numUnallocated += findMapBlockIndex(file, i) == 0;
+        }
+        if (fserror == FS_NONE && !reserveBits(&dataBitmap, numUnallocated))
+            fserror = FS_OUT_OF_SPACE;
+        else if (fserror == FS_NONE) {
+            file->numAllocatingBlocks = numUnallocated;
+            //Each run of unallocated blocks is given as few runs of disk blocks as the disk allows
+            for (unsigned int i = 0; i < numBlocks && fserror == FS_NONE; i += runBlocks) {
+                runBlocks = findContiguousBlocks(file, i, numBlocks - i, &mapping);
+                if (!runBlocks)
+                    fserror = FS_IO_ERROR;
+                else if (mapping == 0)
+                    runBlocks = allocateDataBlocks(file, i, runBlocks, UNWRITTEN_BLOCK);
+            }
+            releaseBits(&dataBitmap, file->numAllocatingBlocks);
+            file->numAllocatingBlocks = 0;
+            if (!writeBackFile(file) && fserror == FS_NONE)
+                fserror = FS_IO_ERROR;
+        }
+    }
+    pthread_mutex_unlock(&file->lock);
+    endTransaction(numMetadataBlocks);
+
+    return fserror == FS_NONE;
+}
+
+unsigned long fileLength(File file) {
+    unsigned long fileSize;
+
+    fserror = FS_NONE;
+    if (!file) {
+        fserror = FS_FILE_NOT_OPEN;
+        return 0;
+    }
+    pthread_mutex_lock(&file->lock);
+    fileSize = file->inode.fileSize;
+    pthread_mutex_unlock(&file->lock);
+    return fileSize;
+}
+
+//Deletes the closed file in the given directory slot: its directory item, its inode and, once the running
+//transaction commits, its blocks. The caller holds the directory lock exclusively and has a transaction handle.
+int removeFile(int slot, DirectoryItem *directory) {
+    Inode inode;
+
+    if (!readInode(directory->inodeIndex, &inode) || !freeInodeBlocks(&inode))
+        return 0;
+    bzero(&inode, sizeof(Inode));
+    if (!writeInode(directory->inodeIndex, inode) || !setInodeStatus(directory->inodeIndex, 0)
+            || !removeDirectoryItem(slot)) {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    return 1;
+}
+
+int deleteFile(char *name) {
+
+    DirectoryItem directory;
+    int slot;
+    fserror = FS_NONE;
+    if (!mountFilesystem() || !startTransaction(operationBlocks(0)))
+        return 0;
+    pthread_rwlock_wrlock(&directoryLock);
+    slot = findDirectoryItem(&directory, name);
+    if (slot < 0) {
+        if (fserror == FS_NONE)
+            fserror = FS_FILE_NOT_FOUND;
+    }
+    else if (isSlotOpen(slot)) {
+        fserror = FS_FILE_OPEN;
+    }
+    else {
+        removeFile(slot, &directory);
+    }
+    pthread_rwlock_unlock(&directoryLock);
+    if (fserror == FS_NONE && !writeBackMetadata())
+        fserror = FS_IO_ERROR;
+    endTransaction(operationBlocks(0));
+
+    return fserror == FS_NONE;
+    
+}
+
+File openFile(char *name, FileMode mode) {
+    int slot;
+    fserror = FS_NONE;
+    if (!mountFilesystem())
+        return 0;
+
+    File file = (File) malloc(sizeof(FileInternals));
+
+    bzero(file, sizeof(FileInternals));
+    file->position = 0;
+    file->fileMode = mode;
+
+    //Holding the directory lock keeps the file from being deleted between the lookup and marking it open
+    pthread_rwlock_rdlock(&directoryLock);
+    slot = findDirectoryItem(&file->directory, name);
+    if (slot < 0) {
+        if (fserror == FS_NONE)
+            fserror=FS_FILE_NOT_FOUND;
+    }
+    else if (!openSlot(slot, file)) {
+        fserror = FS_FILE_OPEN;
+    }
+    else if (!readInode(file->directory.inodeIndex, &file->inode)) {
+        __atomic_store_n(&directoryIndex.openSlots[slot], 0, __ATOMIC_RELEASE);
+    }
+    else {
+        pthread_rwlock_unlock(&directoryLock);
+        file->directorySlot = slot;
+        file->directory.open = 1;
+        pthread_mutex_init(&file->lock, NULL);
+        addOpenFile(file);
+        return file;
+    }
+    pthread_rwlock_unlock(&directoryLock);
+    free(file);
+    return 0;
+}
+
+void closeFile(File file) {
+    unsigned int numBlocks;
+
+    fserror = FS_NONE;
+    //Off the list first, so fs_sync doesn't write the file back while it goes away. Only one of two closes racing
+    //for the same handle finds it there.
+    if (!file || !removeOpenFile(file)) {
+        fserror = FS_FILE_NOT_OPEN;
+        return;
+    }
+    //The transaction only needs room for what the file has left to write back
+    numBlocks = startFileWriteBack(file);
+    if (!numBlocks)
+        pthread_mutex_lock(&file->lock);
     file->directory.open = 0;
-    if (!write_sd_block(&file->directory, file->directoryItemBlockIndex))
+    if (numBlocks && (!flushDelayedBlocks(file) || !writeBackFile(file)) && fserror == FS_NONE)
         fserror=FS_IO_ERROR;
-    
+    //Delayed blocks that couldn't be written give their space back
+    releaseBits(&dataBitmap, file->numReservedBlocks);
+    pthread_mutex_unlock(&file->lock);
+    if (numBlocks)
+        endTransaction(numBlocks);
+    //The inode is written back by now, so opening the file again reads the new one. The handle stops finding the
+    //file from here on, so it can be freed.
+    __atomic_store_n(&directoryIndex.openSlots[file->directorySlot], 0, __ATOMIC_RELEASE);
+    pthread_mutex_destroy(&file->lock);
+    free(file->mapBlocks);
+    free(file->delayedBlocks);
+    free(file->readAheadBlocks);
+    free(file);
+}
+
+//Writes back what every open file holds in memory and the inode table and bitmaps, commits the journal and flushes
+//the block cache, so everything written so far is home on disk. No operation takes the open files lock with a
+//transaction handle open, so transactions can be started while holding it.
+int syncFilesystem(void) {
+    unsigned int numBlocks;
+    int ret = 1;
+
+    fserror = FS_NONE;
+    if (!__atomic_load_n(&mounted, __ATOMIC_ACQUIRE))
+        return 1;
+    pthread_mutex_lock(&openFilesLock);
+    for (File file = openFiles; ret && file; file = file->nextOpenFile) {
+        numBlocks = startFileWriteBack(file);
+        ret = numBlocks > 0;
+        if (ret) {
+            ret = flushDelayedBlocks(file) && writeBackFile(file);
+            pthread_mutex_unlock(&file->lock);
+            endTransaction(numBlocks);
+        }
+    }
+    pthread_mutex_unlock(&openFilesLock);
+    if (ret && (ret = startTransaction(operationBlocks(0)))) {
+        ret = writeBackMetadata();
+        endTransaction(operationBlocks(0));
+    }
+    ret = ret && commitJournal() && flush_block_cache();
+    if (!ret && fserror == FS_NONE)
+        fserror = FS_IO_ERROR;
+    return ret;
+}
+
+//Syncs the filesystem when the program exits. Nothing else is expected to be using the filesystem by then.
+static void flushAtExit(void) {
+    syncFilesystem();
+}
+
+int fs_mount(void) {
+    fserror = FS_NONE;
+    return mountFilesystem();
+}
+
+int fs_sync(void) {
+    return syncFilesystem();
+}
+
+int fs_unmount(void) {
+    int open;
+
+    fserror = FS_NONE;
+    pthread_mutex_lock(&openFilesLock);
+    open = openFiles != NULL;
+    pthread_mutex_unlock(&openFilesLock);
+    if (open) {
+        fserror = FS_FILE_OPEN;
+        return 0;
+    }
+    if (!syncFilesystem())
+        return 0;
+    unmountFilesystem();
+    return 1;
+}
+
+int fileExists(char * name) {
+    DirectoryItem directory;
+    int exists;
+    fserror = FS_NONE;
+    if (!mountFilesystem())
+        return 0;
+    pthread_rwlock_rdlock(&directoryLock);
+    exists = findDirectoryItem(&directory, name) >= 0;
+    pthread_rwlock_unlock(&directoryLock);
+    return exists;
+}
+
+//Most metadata blocks changed by creating or deleting numFiles files at once: an inode block and a directory block
+//for each and every bitmap block.
+unsigned int batchBlocks(unsigned long numFiles) {
+    return 2 * numFiles + superblock.numInodeBitmapBlocks + superblock.numDataBitmapBlocks;
+}
+
+//How many of the count files left in a batch go into one transaction.
+unsigned long batchChunk(unsigned long count) {
+    unsigned long chunk = BATCH_CHUNK_FILES;
+    while (chunk > 1 && batchBlocks(chunk) > journal.maxTransactionBlocks)
+        chunk /= 2;
+    return chunk < count ? chunk : count;
+}
+
+//Sets the status of every file from start on, and fserror, to the error that stopped a batch.
+void failBatch(FSError *status, unsigned long start, unsigned long count, FSError error) {
+    for (unsigned long i = start; i < count; i++)
+        status[i] = error;
+    fserror = error;
 }
 
-int file_exists(char * name) {
+unsigned long createFiles(char **names, unsigned long count, void **contents, unsigned long *lengths, FSError *status) {
+    FSError firstError = FS_NONE;
     DirectoryItem directory;
-    return findDirectoryItem(&directory, name);
+    Inode inode;
+    File file;
+    unsigned long chunk, numCreated = 0;
+    int slot;
+
+    fserror = FS_NONE;
+    if (!mountFilesystem()) {
+        failBatch(status, 0, count, fserror);
+        return 0;
+    }
+    for (unsigned long start = 0; start < count; start += chunk) {
+        chunk = batchChunk(count - start);
+        //Every file of the chunk, and the bitmap blocks they share, are committed together
+        if (!startTransaction(batchBlocks(chunk))) {
+            failBatch(status, start, count, fserror);
+            return numCreated;
+        }
+        pthread_rwlock_wrlock(&directoryLock);
+        for (unsigned long i = start; i < start + chunk; i++) {
+            fserror = FS_NONE;
+            bzero(&inode, sizeof(Inode));
+            inode.flags = INODE_INLINE_DATA;
+            if (contents && lengths[i] <= MAX_INLINE_BYTES) {
+                memcpy(inode.blocks, contents[i], lengths[i]);
+                inode.fileSize = lengths[i];
+            }
+            slot = addFile(names[i], &inode, &directory);
+            status[i] = slot < 0 ? fserror : FS_NONE;
+        }
+        pthread_rwlock_unlock(&directoryLock);
+        if (!writeBackMetadata()) {
+            for (unsigned long i = start; i < start + chunk; i++) {
+                if (status[i] == FS_NONE)
+                    status[i] = FS_IO_ERROR;
+            }
+        }
+        endTransaction(batchBlocks(chunk));
+    }
+
+    for (unsigned long i = 0; i < count; i++) {
+        //Contents too big for the inode are written the usual way
+        if (status[i] == FS_NONE && contents && lengths[i] > MAX_INLINE_BYTES) {
+            file = openFile(names[i], READ_WRITE);
+            if (!file)
+                status[i] = fserror;
+            else {
+                if (writeFile(file, contents[i], lengths[i]) != lengths[i])
+                    status[i] = fserror != FS_NONE ? fserror : FS_IO_ERROR;
+                closeFile(file);
+                if (status[i] == FS_NONE)
+                    status[i] = fserror;
+            }
+        }
+        if (status[i] == FS_NONE)
+            numCreated++;
+        else if (firstError == FS_NONE)
+            firstError = status[i];
+    }
+    fserror = firstError;
+    return numCreated;
+}
+
+unsigned long deleteFiles(char **names, unsigned long count, FSError *status) {
+    FSError firstError = FS_NONE;
+    DirectoryItem directory;
+    unsigned long chunk, numDeleted = 0;
+    int slot;
+
+    fserror = FS_NONE;
+    if (!mountFilesystem()) {
+        failBatch(status, 0, count, fserror);
+        return 0;
+    }
+    for (unsigned long start = 0; start < count; start += chunk) {
+        chunk = batchChunk(count - start);
+        if (!startTransaction(batchBlocks(chunk))) {
+            failBatch(status, start, count, fserror);
+            return numDeleted;
+        }
+        pthread_rwlock_wrlock(&directoryLock);
+        for (unsigned long i = start; i < start + chunk; i++) {
+            fserror = FS_NONE;
+            slot = names[i] ? findDirectoryItem(&directory, names[i]) : -1;
+            if (slot < 0) {
+                if (fserror == FS_NONE)
+                    fserror = FS_FILE_NOT_FOUND;
+            }
+            else if (isSlotOpen(slot))
+                fserror = FS_FILE_OPEN;
+            else
+                removeFile(slot, &directory);
+            status[i] = fserror;
+        }
+        pthread_rwlock_unlock(&directoryLock);
+        if (!writeBackMetadata()) {
+            for (unsigned long i = start; i < start + chunk; i++) {
+                if (status[i] == FS_NONE)
+                    status[i] = FS_IO_ERROR;
+            }
+        }
+        endTransaction(batchBlocks(chunk));
+        for (unsigned long i = start; i < start + chunk; i++) {
+            if (status[i] == FS_NONE)
+                numDeleted++;
+            else if (firstError == FS_NONE)
+                firstError = status[i];
+        }
+    }
+    fserror = firstError;
+    return numDeleted;
+}
+
+//The public functions below time and count every call of the ones above, which are given the files that user code's
+//handles refer to.
+
+File create_file(char *name) {
+    OperationTimer timer;
+    File file;
+
+    startOperation(&timer, FS_OP_CREATE_FILE);
+    file = fileHandle(createFile(name));
+    endOperation(&timer, FS_OP_CREATE_FILE, 0);
+    return file;
+}
+
+File open_file(char *name, FileMode mode) {
+    OperationTimer timer;
+    File file;
+
+    startOperation(&timer, FS_OP_OPEN_FILE);
+    file = fileHandle(openFile(name, mode));
+    endOperation(&timer, FS_OP_OPEN_FILE, 0);
+    return file;
+}
+
+void close_file(File file) {
+    OperationTimer timer;
+
+    startOperation(&timer, FS_OP_CLOSE_FILE);
+    closeFile(findOpenFile(file));
+    endOperation(&timer, FS_OP_CLOSE_FILE, 0);
+}
+
+unsigned long read_file(File file, void *buf, unsigned long numbytes) {
+    OperationTimer timer;
+    unsigned long bytesRead;
+
+    startOperation(&timer, FS_OP_READ_FILE);
+    bytesRead = readFile(findOpenFile(file), buf, numbytes);
+    endOperation(&timer, FS_OP_READ_FILE, bytesRead);
+    return bytesRead;
+}
+
+unsigned long view_file(File file, FileView *view, unsigned long numbytes) {
+    OperationTimer timer;
+    unsigned long bytesViewed;
+
+    startOperation(&timer, FS_OP_VIEW_FILE);
+    bytesViewed = viewFile(findOpenFile(file), view, numbytes);
+    endOperation(&timer, FS_OP_VIEW_FILE, bytesViewed);
+    return bytesViewed;
+}
+
+unsigned long write_file(File file, void *buf, unsigned long numbytes) {
+    OperationTimer timer;
+    unsigned long bytesWritten;
+
+    startOperation(&timer, FS_OP_WRITE_FILE);
+    bytesWritten = writeFile(findOpenFile(file), buf, numbytes);
+    endOperation(&timer, FS_OP_WRITE_FILE, bytesWritten);
+    return bytesWritten;
+}
+
+int seek_file(File file, unsigned long bytepos) {
+    OperationTimer timer;
+    int ret;
+
+    startOperation(&timer, FS_OP_SEEK_FILE);
+    ret = seekFile(findOpenFile(file), bytepos);
+    endOperation(&timer, FS_OP_SEEK_FILE, 0);
+    return ret;
+}
+
+int preallocate_file(File file, unsigned long numbytes) {
+    OperationTimer timer;
+    int ret;
+
+    startOperation(&timer, FS_OP_PREALLOCATE_FILE);
+    ret = preallocateFile(findOpenFile(file), numbytes);
+    endOperation(&timer, FS_OP_PREALLOCATE_FILE, 0);
+    return ret;
+}
+
+int file_region(File file, unsigned long bytepos, unsigned long *length) {
+    OperationTimer timer;
+    int data;
+
+    startOperation(&timer, FS_OP_FILE_REGION);
+    data = fileRegion(findOpenFile(file), bytepos, length);
+    endOperation(&timer, FS_OP_FILE_REGION, 0);
+    return data;
+}
+
+unsigned long file_length(File file) {
+    return fileLength(findOpenFile(file));
+}
+
+int delete_file(char *name) {
+    OperationTimer timer;
+    int ret;
+
+    startOperation(&timer, FS_OP_DELETE_FILE);
+    ret = deleteFile(name);
+    endOperation(&timer, FS_OP_DELETE_FILE, 0);
+    return ret;
+}
+
+unsigned long create_files(char **names, unsigned long count, void **contents, unsigned long *lengths,
+                           FSError *status) {
+    OperationTimer timer;
+    unsigned long numCreated;
+
+    startOperation(&timer, FS_OP_CREATE_FILES);
+    numCreated = createFiles(names, count, contents, lengths, status);
+    endOperation(&timer, FS_OP_CREATE_FILES, 0);
+    return numCreated;
+}
+
+unsigned long delete_files(char **names, unsigned long count, FSError *status) {
+    OperationTimer timer;
+    unsigned long numDeleted;
+
+    startOperation(&timer, FS_OP_DELETE_FILES);
+    numDeleted = deleteFiles(names, count, status);
+    endOperation(&timer, FS_OP_DELETE_FILES, 0);
+    return numDeleted;
+}
+
+int file_exists(char *name) {
+    OperationTimer timer;
+    int exists;
+
+    startOperation(&timer, FS_OP_FILE_EXISTS);
+    exists = fileExists(name);
+    endOperation(&timer, FS_OP_FILE_EXISTS, 0);
+    return exists;
+}
+
+void fs_get_stats(FSStats *stats) {
+    unsigned long *counters = (unsigned long *)stats, *baseline = (unsigned long *)&statsBaseline;
+
+    pthread_mutex_lock(&statsLock);
+    sumThreadStats(stats);
+    for (unsigned long i = 0; i < sizeof(FSStats) / sizeof(unsigned long); i++)
+        counters[i] -= baseline[i];
+    pthread_mutex_unlock(&statsLock);
+}
+
+void fs_reset_stats(void) {
+    pthread_mutex_lock(&statsLock);
+    sumThreadStats(&statsBaseline);
+    pthread_mutex_unlock(&statsLock);
+}
+
+//Writes a number of nanoseconds as a short duration in the largest unit it has a whole number of.
+void formatDuration(char *text, unsigned long nanoseconds) {
+    if (nanoseconds >= 1000000000UL)
+        sprintf(text, "%lus", nanoseconds / 1000000000UL);
+    else if (nanoseconds >= 1000000UL)
+        sprintf(text, "%lums", nanoseconds / 1000000UL);
+    else if (nanoseconds >= 1000UL)
+        sprintf(text, "%luus", nanoseconds / 1000UL);
+    else
+        sprintf(text, "%luns", nanoseconds);
+}
+
+void fs_print_stats(void) {
+    FSStats stats;
+    FSOperationStats *operation;
+    char low[16];
+
+    fs_get_stats(&stats);
+    printf("%-17s %10s %8s %14s %12s %14s %10s\n", "operation", "calls", "errors", "bytes", "blocks read",
+           "blocks written", "mean us");
+    for (int i = 0; i < FS_NUM_OPERATIONS; i++) {
+        operation = &stats.operations[i];
+        if (operation->calls == 0)
+            continue;
+        printf("%-17s %10lu %8lu %14lu %12lu %14lu %10.2f\n", operationNames[i], operation->calls, operation->errors,
+               operation->bytes, operation->blocks_read, operation->blocks_written,
+               operation->nanoseconds / 1000.0 / operation->calls);
+        //Each bucket is labelled with the shortest call it counts
+        printf("  latency:");
+        for (int bucket = 0; bucket < FS_LATENCY_BUCKETS; bucket++) {
+            if (operation->latency[bucket] == 0)
+                continue;
+            formatDuration(low, bucket ? 1UL << bucket : 0);
+            printf(" %s:%lu", low, operation->latency[bucket]);
+        }
+        printf("\n");
+    }
+    printf("%-17s %10s %14s\n", "path", "calls", "steps");
+    for (int i = 0; i < FS_NUM_PATHS; i++)
+        printf("%-17s %10lu %14lu\n", pathNames[i], stats.paths[i].calls, stats.paths[i].steps);
 }
 
 void fs_print_error(void) {
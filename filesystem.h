@@ -1,10 +1,28 @@
 
+#include "softwaredisk.h"
+
 // main private file type: you implement this in filesystem.c
 struct FileInternals;
 
-// file type used by user code
+// file type used by user code: a handle to an open file, not to be
+// dereferenced.  Handles are never reused, so one that has been closed
+// is recognized as such.
 typedef struct FileInternals* File;
 
+// longest file name, in characters.  Directory items are packed four to a
+// block on disk, which cut this from 127 in the original one item per block
+// format.  Functions given a longer name fail with FS_ILLEGAL_FILENAME
+// rather than truncating it.
+#define FS_MAX_NAME_LENGTH 121
+
+// read-only view of part of a file's data, filled in by view_file()
+typedef struct FileView {
+  const void *data;        // 'length' bytes of the file, valid until release_view()
+  unsigned long length;
+  unsigned long blocknum;  // pinned disk block, 0 if the data is in 'copy'
+  unsigned char copy[SOFTWARE_DISK_BLOCK_SIZE]; // data not on the software disk yet
+} FileView;
+
 // access mode for open_file() 
 typedef enum {
 	READ_ONLY, READ_WRITE
@@ -21,11 +39,88 @@ typedef enum  {
   FS_FILE_READ_ONLY, 	   // attempted write to file opened for READ_ONLY
   FS_FILE_ALREADY_EXISTS,  // attempted creation of file with existing name
   FS_EXCEEDS_MAX_FILE_SIZE,// seek or write would exceed max file size
-  FS_ILLEGAL_FILENAME,     // filename begins with a null character
+  FS_ILLEGAL_FILENAME,     // filename begins with a null character or is
+                           // longer than FS_MAX_NAME_LENGTH
   FS_IO_ERROR              // something really bad happened
 } FSError;
 
-// function prototypes for filesystem API
+// public functions counted by fs_get_stats().  The software disk requests
+// each of them makes are tagged with its FSOperation + 1 in block I/O traces
+// (see set_sd_trace_caller()).
+typedef enum {
+  FS_OP_CREATE_FILE, FS_OP_OPEN_FILE, FS_OP_CLOSE_FILE, FS_OP_READ_FILE, FS_OP_VIEW_FILE, FS_OP_WRITE_FILE,
+  FS_OP_SEEK_FILE, FS_OP_PREALLOCATE_FILE, FS_OP_DELETE_FILE, FS_OP_FILE_EXISTS, FS_OP_FILE_REGION,
+  FS_OP_CREATE_FILES, FS_OP_DELETE_FILES,
+  FS_NUM_OPERATIONS
+} FSOperation;
+
+// internal paths counted by fs_get_stats()
+typedef enum {
+  FS_PATH_BITMAP_SCAN,       // searches of an allocation bitmap; steps are 64-bit words examined
+  FS_PATH_DIRECTORY_SCAN,    // name lookups and directory loads; steps are directory items examined
+  FS_PATH_INDIRECT_LOOKUP,   // lookups of blocks past the direct blocks; steps are indirect blocks read in
+  FS_NUM_PATHS
+} FSPath;
+
+// latency histogram size: bucket i counts calls that took from 2^i up to
+// 2^(i+1) nanoseconds, and the last bucket every slower call as well
+#define FS_LATENCY_BUCKETS 32
+
+// counters for one public function
+typedef struct FSOperationStats {
+  unsigned long calls;
+  unsigned long errors;          // calls that left 'fserror' set to something other than FS_NONE
+  unsigned long bytes;           // read, viewed or written
+  unsigned long blocks_read;     // blocks read from the block cache
+  unsigned long blocks_written;  // blocks written to the block cache or the journal
+  unsigned long nanoseconds;     // time spent in the calls
+  unsigned long latency[FS_LATENCY_BUCKETS];
+} FSOperationStats;
+
+// counters for one internal path
+typedef struct FSPathStats {
+  unsigned long calls;
+  unsigned long steps;
+} FSPathStats;
+
+// everything fs_get_stats() reports
+typedef struct FSStats {
+  FSOperationStats operations[FS_NUM_OPERATIONS];
+  FSPathStats paths[FS_NUM_PATHS];
+} FSStats;
+
+// function prototypes for filesystem API.  Every function may be called from
+// several threads at once; operations on different files run in parallel and
+// operations on the same file are serialized.
+
+// formats the software disk, laying out room for 'numinodes' files and
+// 'numdirectoryitems' directory entries over the whole disk and writing the
+// layout to a superblock in block 0.  Files may grow to 'maxfilesize' bytes,
+// or as large as an inode can map if 'maxfilesize' is 0.  Every existing file
+// is destroyed, and no file may be open.  Other filesystem functions read the
+// superblock the first time they are used. Returns 1 on success and 0 on
+// failure.  Always sets 'fserror' global.
+int fs_format(unsigned long numinodes, unsigned long numdirectoryitems, unsigned long maxfilesize);
+
+// mounts the filesystem: reads the superblock, replays the journal and loads
+// the inode table and directory into memory, where they stay until
+// fs_unmount().  Which files are open is only ever kept in memory.  The
+// other functions mount the filesystem themselves if it isn't mounted, so
+// calling this is optional.  Returns 1 on success and 0 on failure.  Always
+// sets 'fserror' global.
+int fs_mount(void);
+
+// writes everything the filesystem holds in memory, including data written
+// to files that are still open, home to the software disk and syncs it.
+// This also happens when the program exits.  Returns 1 on success and 0 on
+// failure.  Always sets 'fserror' global.
+int fs_sync(void);
+
+// syncs the filesystem like fs_sync() and drops everything it keeps in
+// memory.  Fails with FS_FILE_OPEN if a file is still open.  No other
+// filesystem function may be running.  Returns 1 on success and 0 on
+// failure.  Always sets 'fserror' global.
+int fs_unmount(void);
 
 // open existing file with pathname 'name' and access mode 'mode'.  Current file
 // position is set at byte 0.  Returns NULL on error. Always sets 'fserror' global.
@@ -38,7 +133,10 @@ File open_file(char *name, FileMode mode);
 File create_file(char *name);
 
 
-// close 'file'.  Always sets 'fserror' global.
+// close 'file', which may not be used afterwards: every call given it after
+// it is closed, including closing it again, fails with FS_FILE_NOT_OPEN.  A
+// file may not be closed while another thread is using it.  Always sets
+// 'fserror' global.
 void close_file(File file);
 
 // read at most 'numbytes' of data from 'file' into 'buf', starting at the 
@@ -47,6 +145,21 @@ void close_file(File file);
 // 'fserror' global.
 unsigned long read_file(File file, void *buf, unsigned long numbytes);
 
+// points 'view' at up to 'numbytes' bytes of 'file', starting at the current
+// file position, without copying them out of the block cache, and advances
+// the position past them.  A view never crosses a block boundary, so reading
+// on returns the following views.  The block behind the view stays cached
+// until release_view(); if the file is written meanwhile the view shows the
+// new data.  The view holds the disk block, not the file: once the file is
+// deleted its blocks can go to another file, whose data the view then shows,
+// so release views of a file before deleting it.  Returns the number of bytes
+// in the view, 0 at end of file.
+// Always sets 'fserror' global.
+unsigned long view_file(File file, FileView *view, unsigned long numbytes);
+
+// releases a view filled in by view_file().
+void release_view(FileView *view);
+
 // write 'numbytes' of data from 'buf' into 'file' at the current file position. 
 // Returns the number of bytes written. On an out of space error, the return value may be
 // less than 'numbytes'.  Always sets 'fserror' global.
@@ -58,6 +171,25 @@ unsigned long write_file(File file, void *buf, unsigned long numbytes);
 // sets 'fserror' global.
 int seek_file(File file, unsigned long bytepos);
 
+// reserves disk blocks for the first 'numbytes' bytes of 'file', in as few
+// contiguous runs as the software disk allows, so later writes to them can't
+// run out of space.  Blocks the file already has are left alone.  Reserved
+// blocks read as zeros until they are written.  The file's length doesn't
+// change.  Returns 1 on success and 0 on failure, in which case some of the
+// blocks may have been reserved.  Always sets 'fserror' global.
+int preallocate_file(File file, unsigned long numbytes);
+
+// tells what is at byte 'bytepos' of 'file': returns 1 for data, or 0 for a
+// hole, which reads as zeros without reading the disk.  Blocks that were
+// never written are holes, and so are blocks only reserved by
+// preallocate_file().  Holes take no disk space unless they were reserved;
+// whole blocks of zeros written where the file has no disk block stay
+// holes.  '*length' is set to the number of bytes from 'bytepos' to the end
+// of the region, which is whole blocks except at the end of the file, or to 0
+// if 'bytepos' is at or past the end of the file.  Returns -1 on failure.
+// Always sets 'fserror' global.
+int file_region(File file, unsigned long bytepos, unsigned long *length);
+
 // returns the current length of the file in bytes. Always sets 'fserror' global.
 unsigned long file_length(File file);
 
@@ -65,6 +197,23 @@ unsigned long file_length(File file);
 // Always sets 'fserror' global.   
 int delete_file(char *name); 
 
+// creates a file for each of the 'count' names in 'names', as create_file()
+// would but closed.  If 'contents' isn't NULL, each file starts out holding
+// the 'lengths[i]' bytes at 'contents[i]'.  Lookups, inode allocation,
+// bitmap updates and the journal transaction are shared by the whole batch
+// rather than paid for each file.  'status[i]' is set to FS_NONE or to the
+// error creating 'names[i]' met.  Returns the number of files created.
+// Always sets 'fserror' global, to the first error of the batch.
+unsigned long create_files(char **names, unsigned long count, void **contents, unsigned long *lengths,
+                           FSError *status);
+
+// deletes each of the 'count' files named in 'names', as delete_file()
+// would, sharing lookups, bitmap updates and the journal transaction across
+// the batch.  'status[i]' is set to FS_NONE or to the error deleting
+// 'names[i]' met.  Returns the number of files deleted.  Always sets
+// 'fserror' global, to the first error of the batch.
+unsigned long delete_files(char **names, unsigned long count, FSError *status);
+
 // determines if a file with 'name' exists and returns 1 if it exists, otherwise 0.
 // Always sets 'fserror' global.
 int file_exists(char *name);
@@ -73,6 +222,19 @@ int file_exists(char *name);
 // error.
 void fs_print_error(void);
 
-// filesystem error code set (set by each filesystem function)
-extern FSError fserror;
+// copies the counters of every thread, since fs_reset_stats() was last
+// called, into 'stats'.  Counting is always on; each thread keeps its own
+// counters, so it costs a few loads and stores per call.
+void fs_get_stats(FSStats *stats);
+
+// starts the counters over from zero.
+void fs_reset_stats(void);
+
+// prints the counters, with a latency histogram for each public function that
+// has been called, to standard output.
+void fs_print_stats(void);
+
+// filesystem error code set (set by each filesystem function).  Each thread
+// has its own.
+extern __thread FSError fserror;
  
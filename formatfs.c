@@ -1,12 +1,47 @@
 //initializes the filesystem for the assignment.
-//requires a completely zeroed out software disk
+//usage: formatfs [numblocks [numinodes [numdirectoryitems [maxfilebytes]]]]
+//creates a zeroed software disk of numblocks blocks and formats it with room for numinodes files and
+//numdirectoryitems directory entries, each file up to maxfilebytes long (0 for as large as an inode can map)
 
 #include <stdio.h>
+#include <stdlib.h>
 #include "softwaredisk.h"
+#include "filesystem.h"
+
+#define DEFAULT_NUM_INODES 896
+#define DEFAULT_MAX_FILE_BYTES 135680 //Nine direct blocks and an indirect block of 256 mappings, as before the superblock
 
 int main(int argc, char *argv[]){
+    unsigned long numBlocks = SOFTWARE_DISK_DEFAULT_BLOCKS;
+    unsigned long numInodes = DEFAULT_NUM_INODES;
+    unsigned long numDirectoryItems;
+    unsigned long maxFileBytes = DEFAULT_MAX_FILE_BYTES;
+
+    if (argc > 5) {
+        printf("usage: %s [numblocks [numinodes [numdirectoryitems [maxfilebytes]]]]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 1)
+        numBlocks = strtoul(argv[1], NULL, 0);
+    if (argc > 2)
+        numInodes = strtoul(argv[2], NULL, 0);
+    numDirectoryItems = numInodes; //One directory entry per file unless told otherwise
+    if (argc > 3)
+        numDirectoryItems = strtoul(argv[3], NULL, 0);
+    if (argc > 4)
+        maxFileBytes = strtoul(argv[4], NULL, 0);
+
     printf("Initializing filesystem...");
-    init_software_disk();
+    if (!init_software_disk_blocks(numBlocks)) {
+        printf("failed.\n");
+        sd_print_error();
+        return 1;
+    }
+    if (!fs_format(numInodes, numDirectoryItems, maxFileBytes)) {
+        printf("failed.\n");
+        fs_print_error();
+        return 1;
+    }
     printf("done.\n");
 
     return 0;
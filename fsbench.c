@@ -0,0 +1,331 @@
+//times the filesystem API and reports the results as JSON on standard output.
+//usage: fsbench [-n numfiles] [-s smallbytes] [-l largebytes] [-i iobytes] [-r randomreads] [-b numblocks]
+//               [-t tracefile]
+//creates a fresh software disk (destroying the existing one), formats it and runs each phase in turn: create, close,
+//open, small-file write, large sequential write and read, random seek+read, file_exists hit and miss, and delete.
+//Every phase reports its operations per second, latency percentiles and what it cost the block cache and the
+//software disk, so two builds can be compared by running both and diffing the numbers. With -t the software disk
+//requests of every phase are recorded as a block I/O trace, for sdreplay.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "softwaredisk.h"
+#include "blockcache.h"
+#include "filesystem.h"
+
+#define DEFAULT_NUM_FILES 1000
+#define DEFAULT_SMALL_BYTES 4096
+#define DEFAULT_LARGE_BYTES (8 * 1024 * 1024)
+#define DEFAULT_IO_BYTES 65536 //Chunk size of the sequential phases
+#define RANDOM_READ_BYTES 4096
+#define DEFAULT_RANDOM_READS 2000
+
+//Settings for one run, from the command line
+typedef struct BenchConfig {
+    unsigned long numFiles;
+    unsigned long smallBytes;
+    unsigned long largeBytes;
+    unsigned long ioBytes;
+    unsigned long randomReads;
+    unsigned long numBlocks;
+    const char *tracePath; //NULL unless tracing
+} BenchConfig;
+
+//One timed phase: a latency for each operation and the counters from before it started
+typedef struct Phase {
+    const char *name;
+    unsigned long numOps;
+    unsigned long bytes; //Data moved by the phase, 0 for metadata-only phases
+    double *latencies; //In seconds, one per operation
+    double startTime;
+    double seconds;
+    SDStats disk;
+    BlockCacheStats cache;
+    int failed;
+} Phase;
+
+static int firstPhase = 1;
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+//The latency below which the given fraction of the phase's operations finished, in microseconds.
+double percentile(Phase *phase, double fraction) {
+    unsigned long i = (unsigned long)(fraction * (phase->numOps - 1) + 0.5);
+    return phase->latencies[i] * 1e6;
+}
+
+void startPhase(Phase *phase, const char *name, unsigned long numOps) {
+    bzero(phase, sizeof(Phase));
+    phase->name = name;
+    phase->latencies = malloc((numOps + 1) * sizeof(double));
+    if (!phase->latencies) {
+        fprintf(stderr, "fsbench: out of memory\n");
+        exit(1);
+    }
+    get_sd_stats(&phase->disk);
+    get_block_cache_stats(&phase->cache);
+    phase->startTime = now();
+}
+
+//Records how long one operation took, given the time it started.
+void recordOp(Phase *phase, double opStart) {
+    phase->latencies[phase->numOps++] = now() - opStart;
+}
+
+//Notes on standard error that an operation failed, once per phase, keeping standard output valid JSON.
+void failOp(Phase *phase, const char *what, unsigned long i) {
+    if (!phase->failed)
+        fprintf(stderr, "fsbench: %s: %s failed at operation %lu with fserror %d\n", phase->name, what, i, fserror);
+    phase->failed = 1;
+}
+
+//Prints a finished phase as one element of the phases array.
+void endPhase(Phase *phase) {
+    SDStats disk;
+    BlockCacheStats cache;
+
+    phase->seconds = now() - phase->startTime;
+    get_sd_stats(&disk);
+    get_block_cache_stats(&cache);
+    qsort(phase->latencies, phase->numOps, sizeof(double), compareDoubles);
+
+    printf("%s    {\"name\": \"%s\", \"ops\": %lu, \"failed\": %s, \"seconds\": %.6f, \"ops_per_sec\": %.1f",
+           firstPhase ? "" : ",\n", phase->name, phase->numOps, phase->failed ? "true" : "false", phase->seconds,
+           phase->seconds > 0 ? phase->numOps / phase->seconds : 0.0);
+    if (phase->bytes > 0)
+        printf(", \"bytes\": %lu, \"mb_per_sec\": %.2f", phase->bytes,
+               phase->seconds > 0 ? phase->bytes / phase->seconds / (1024 * 1024) : 0.0);
+    if (phase->numOps > 0)
+        printf(",\n     \"latency_us\": {\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f}",
+               percentile(phase, 0.5), percentile(phase, 0.9), percentile(phase, 0.99), percentile(phase, 1.0));
+    printf(",\n     \"disk\": {\"reads\": %lu, \"writes\": %lu, \"blocks_read\": %lu, \"blocks_written\": %lu, \"syncs\": %lu}",
+           disk.reads - phase->disk.reads, disk.writes - phase->disk.writes,
+           disk.blocks_read - phase->disk.blocks_read, disk.blocks_written - phase->disk.blocks_written,
+           disk.syncs - phase->disk.syncs);
+    printf(",\n     \"cache\": {\"hits\": %lu, \"misses\": %lu, \"writebacks\": %lu, \"evictions\": %lu}}",
+           cache.hits - phase->cache.hits, cache.misses - phase->cache.misses,
+           cache.writebacks - phase->cache.writebacks, cache.evictions - phase->cache.evictions);
+    firstPhase = 0;
+    free(phase->latencies);
+}
+
+void fileName(char *name, const char *prefix, unsigned long i) {
+    sprintf(name, "%s%06lu", prefix, i);
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig config = { DEFAULT_NUM_FILES, DEFAULT_SMALL_BYTES, DEFAULT_LARGE_BYTES, DEFAULT_IO_BYTES,
+                           DEFAULT_RANDOM_READS, 0, NULL };
+    unsigned long i, done, ret, numChunks;
+    unsigned char *data;
+    char name[64];
+    File *files, f;
+    Phase phase;
+    double opStart;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:l:i:r:b:t:")) != -1) {
+        switch (opt) {
+            case 'n': config.numFiles = strtoul(optarg, NULL, 0); break;
+            case 's': config.smallBytes = strtoul(optarg, NULL, 0); break;
+            case 'l': config.largeBytes = strtoul(optarg, NULL, 0); break;
+            case 'i': config.ioBytes = strtoul(optarg, NULL, 0); break;
+            case 'r': config.randomReads = strtoul(optarg, NULL, 0); break;
+            case 'b': config.numBlocks = strtoul(optarg, NULL, 0); break;
+            case 't': config.tracePath = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-n numfiles] [-s smallbytes] [-l largebytes] [-i iobytes] "
+                        "[-r randomreads] [-b numblocks] [-t tracefile]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (config.numFiles == 0 || config.ioBytes == 0 || config.largeBytes < RANDOM_READ_BYTES) {
+        fprintf(stderr, "fsbench: numfiles and iobytes must be positive and largebytes at least %d\n",
+                RANDOM_READ_BYTES);
+        return 1;
+    }
+    //Twice what the files need, so allocation never runs short, plus room for the journal and the tables
+    if (config.numBlocks == 0)
+        config.numBlocks = 2 * (config.numFiles * ((config.smallBytes + SOFTWARE_DISK_BLOCK_SIZE - 1) / SOFTWARE_DISK_BLOCK_SIZE + 1)
+                                + config.largeBytes / SOFTWARE_DISK_BLOCK_SIZE * 129 / 128 + 2) + 8192;
+
+    if (!init_software_disk_blocks(config.numBlocks)) {
+        sd_print_error();
+        return 1;
+    }
+    if (!fs_format(config.numFiles + 1, config.numFiles + 1, 0)) {
+        fs_print_error();
+        return 1;
+    }
+    if (config.tracePath && !start_sd_trace(config.tracePath)) {
+        fprintf(stderr, "fsbench: can't record a trace in %s\n", config.tracePath);
+        return 1;
+    }
+
+    numChunks = (config.largeBytes + config.ioBytes - 1) / config.ioBytes;
+    files = calloc(config.numFiles, sizeof(File));
+    data = malloc(config.largeBytes > config.smallBytes ? config.largeBytes : config.smallBytes);
+    if (!files || !data) {
+        fprintf(stderr, "fsbench: out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < config.largeBytes || i < config.smallBytes; i++)
+        data[i] = (unsigned char)(i * 31 + 7);
+    srand(1);
+
+    printf("{\n  \"config\": {\"files\": %lu, \"small_bytes\": %lu, \"large_bytes\": %lu, \"io_bytes\": %lu, "
+           "\"random_reads\": %lu, \"random_read_bytes\": %d, \"disk_blocks\": %lu, \"engine\": \"%s\"},\n"
+           "  \"phases\": [\n", config.numFiles, config.smallBytes, config.largeBytes, config.ioBytes,
+           config.randomReads, RANDOM_READ_BYTES, config.numBlocks, sd_async_engine());
+
+    startPhase(&phase, "create", config.numFiles);
+    for (i = 0; i < config.numFiles; i++) {
+        fileName(name, "file", i);
+        opStart = now();
+        files[i] = create_file(name);
+        recordOp(&phase, opStart);
+        if (!files[i])
+            failOp(&phase, "create_file", i);
+    }
+    endPhase(&phase);
+
+    startPhase(&phase, "close", config.numFiles);
+    for (i = 0; i < config.numFiles; i++) {
+        if (!files[i])
+            continue;
+        opStart = now();
+        close_file(files[i]);
+        recordOp(&phase, opStart);
+    }
+    endPhase(&phase);
+
+    startPhase(&phase, "open", config.numFiles);
+    for (i = 0; i < config.numFiles; i++) {
+        fileName(name, "file", i);
+        opStart = now();
+        files[i] = open_file(name, READ_WRITE);
+        recordOp(&phase, opStart);
+        if (!files[i])
+            failOp(&phase, "open_file", i);
+    }
+    endPhase(&phase);
+
+    //Each operation writes a whole small file and closes it, which is when its delayed blocks reach the disk
+    startPhase(&phase, "small_write", config.numFiles);
+    for (i = 0; i < config.numFiles; i++) {
+        if (!files[i])
+            continue;
+        opStart = now();
+        ret = write_file(files[i], data, config.smallBytes);
+        close_file(files[i]);
+        recordOp(&phase, opStart);
+        if (ret != config.smallBytes)
+            failOp(&phase, "write_file", i);
+        phase.bytes += ret;
+    }
+    endPhase(&phase);
+
+    startPhase(&phase, "seq_write", numChunks + 1);
+    f = create_file("large");
+    if (!f)
+        failOp(&phase, "create_file", 0);
+    for (done = 0; f && done < config.largeBytes; done += ret) {
+        unsigned long chunk = config.largeBytes - done < config.ioBytes ? config.largeBytes - done : config.ioBytes;
+        opStart = now();
+        ret = write_file(f, data + done, chunk);
+        recordOp(&phase, opStart);
+        if (ret != chunk) {
+            failOp(&phase, "write_file", phase.numOps - 1);
+            break;
+        }
+        phase.bytes += ret;
+    }
+    if (f) {
+        opStart = now();
+        close_file(f);
+        recordOp(&phase, opStart);
+    }
+    endPhase(&phase);
+
+    startPhase(&phase, "seq_read", numChunks);
+    f = open_file("large", READ_ONLY);
+    if (!f)
+        failOp(&phase, "open_file", 0);
+    for (done = 0; f && done < config.largeBytes; done += ret) {
+        opStart = now();
+        ret = read_file(f, data, config.ioBytes);
+        recordOp(&phase, opStart);
+        if (ret == 0) {
+            failOp(&phase, "read_file", phase.numOps - 1);
+            break;
+        }
+        phase.bytes += ret;
+    }
+    endPhase(&phase);
+
+    startPhase(&phase, "random_read", config.randomReads);
+    for (i = 0; f && i < config.randomReads; i++) {
+        unsigned long offset = (unsigned long)rand() % (config.largeBytes - RANDOM_READ_BYTES + 1);
+        opStart = now();
+        ret = seek_file(f, offset) ? read_file(f, data, RANDOM_READ_BYTES) : 0;
+        recordOp(&phase, opStart);
+        if (ret != RANDOM_READ_BYTES)
+            failOp(&phase, "read_file", i);
+        phase.bytes += ret;
+    }
+    if (f)
+        close_file(f);
+    endPhase(&phase);
+
+    startPhase(&phase, "exists_hit", config.numFiles);
+    for (i = 0; i < config.numFiles; i++) {
+        fileName(name, "file", i);
+        opStart = now();
+        ret = file_exists(name);
+        recordOp(&phase, opStart);
+        if (!ret)
+            failOp(&phase, "file_exists", i);
+    }
+    endPhase(&phase);
+
+    startPhase(&phase, "exists_miss", config.numFiles);
+    for (i = 0; i < config.numFiles; i++) {
+        fileName(name, "missing", i);
+        opStart = now();
+        ret = file_exists(name);
+        recordOp(&phase, opStart);
+        if (ret)
+            failOp(&phase, "file_exists", i);
+    }
+    endPhase(&phase);
+
+    startPhase(&phase, "delete", config.numFiles);
+    for (i = 0; i < config.numFiles; i++) {
+        fileName(name, "file", i);
+        opStart = now();
+        ret = delete_file(name);
+        recordOp(&phase, opStart);
+        if (!ret)
+            failOp(&phase, "delete_file", i);
+    }
+    endPhase(&phase);
+
+    printf("\n  ]\n}\n");
+    if (config.tracePath && !stop_sd_trace())
+        fprintf(stderr, "fsbench: the trace in %s is incomplete\n", config.tracePath);
+    free(files);
+    free(data);
+    return 0;
+}
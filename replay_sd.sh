@@ -0,0 +1,6 @@
+#!/bin/bash
+# builds sdreplay optimized and replays a block I/O trace with it, passing
+# along any options; the JSON report goes to standard output
+SD_SRCS="blockcache.c softwaredisk.c"
+SD_LIBS="-pthread"
+gcc -O2 -o sdreplay sdreplay.c $SD_SRCS $SD_LIBS && ./sdreplay "$@"
@@ -0,0 +1,238 @@
+//replays a block I/O trace recorded with start_sd_trace against a fresh software disk and reports the throughput as
+//JSON on standard output.
+//usage: sdreplay [-t] [-c cacheblocks] tracefile
+//creates a software disk as large as the traced one (destroying the existing one) and makes each traced request of
+//it in turn, as fast as it can, or at the times they were traced with -t. With -c the requests go through a block
+//cache of that many blocks instead of straight to the software disk, and syncs flush the cache, so cache sizes and
+//software disk backends can be compared on the same I/O pattern. A trace that was never stopped is replayed up to
+//its last whole record.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "softwaredisk.h"
+#include "blockcache.h"
+
+#define MAX_CALLERS 256 //One for each value of SDTraceRecord.caller
+
+//What replaying one kind of request added up to
+typedef struct ReplayTotals {
+    unsigned long requests;
+    unsigned long blocks;
+    double seconds; //Spent making the requests
+    double maxSeconds;
+} ReplayTotals;
+
+static const char *opNames[] = { "read", "write", "sync" };
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//Reads the trace in path into records, checking its header. Returns the number of records, or -1 on failure. For
+//a trace that was never stopped, numBlocks is set to the smallest disk its requests fit in.
+long readTrace(const char *path, SDTraceRecord **records, unsigned long *numBlocks) {
+    SDTraceHeader header;
+    long numRecords, size;
+    FILE *trace = fopen(path, "rb");
+
+    if (!trace) {
+        perror(path);
+        return -1;
+    }
+    if (fread(&header, sizeof(header), 1, trace) != 1 || fseek(trace, 0, SEEK_END) != 0
+            || (size = ftell(trace)) < 0 || fseek(trace, sizeof(header), SEEK_SET) != 0) {
+        fprintf(stderr, "sdreplay: can't read %s\n", path);
+        fclose(trace);
+        return -1;
+    }
+    numRecords = (size - (long)sizeof(header)) / (long)sizeof(SDTraceRecord);
+    if (header.magic == SD_TRACE_MAGIC) {
+        if (header.numrecords > numRecords) {
+            fprintf(stderr, "sdreplay: %s is cut short\n", path);
+            fclose(trace);
+            return -1;
+        }
+        numRecords = header.numrecords;
+    }
+    else if (header.magic != 0) {
+        fprintf(stderr, "sdreplay: %s isn't a block I/O trace\n", path);
+        fclose(trace);
+        return -1;
+    }
+    if (header.magic == SD_TRACE_MAGIC && header.block_size != SOFTWARE_DISK_BLOCK_SIZE) {
+        fprintf(stderr, "sdreplay: %s was traced with %u byte blocks, not %d\n", path, header.block_size,
+                SOFTWARE_DISK_BLOCK_SIZE);
+        fclose(trace);
+        return -1;
+    }
+    *records = malloc((numRecords + 1) * sizeof(SDTraceRecord));
+    if (!*records || fread(*records, sizeof(SDTraceRecord), numRecords, trace) != (unsigned long)numRecords) {
+        fprintf(stderr, "sdreplay: can't read %s\n", path);
+        free(*records);
+        fclose(trace);
+        return -1;
+    }
+    fclose(trace);
+
+    *numBlocks = header.numblocks;
+    for (long i = 0; i < numRecords; i++) {
+        if ((*records)[i].op > SD_TRACE_SYNC) {
+            fprintf(stderr, "sdreplay: record %ld of %s has unknown op %u\n", i, path, (*records)[i].op);
+            free(*records);
+            return -1;
+        }
+        //replayRecord() transfers into a buffer of SD_TRACE_MAX_BLOCKS blocks
+        unsigned long count = (*records)[i].count;
+        if ((*records)[i].op != SD_TRACE_SYNC && (count == 0 || count > SD_TRACE_MAX_BLOCKS)) {
+            fprintf(stderr, "sdreplay: record %ld of %s has bad block count %lu\n", i, path, count);
+            free(*records);
+            return -1;
+        }
+        if (header.magic != SD_TRACE_MAGIC && (*records)[i].blocknum + count > *numBlocks)
+            *numBlocks = (*records)[i].blocknum + count;
+    }
+    return numRecords;
+}
+
+//Makes one traced request, of the block cache if useCache is set. Returns 1 on success or 0 on failure.
+int replayRecord(SDTraceRecord *record, void *buf, int useCache) {
+    switch (record->op) {
+        case SD_TRACE_READ:
+            return useCache ? read_cache_blocks(buf, record->blocknum, record->count)
+                            : read_sd_blocks(buf, record->blocknum, record->count);
+        case SD_TRACE_WRITE:
+            return useCache ? write_cache_blocks(buf, record->blocknum, record->count)
+                            : write_sd_blocks(buf, record->blocknum, record->count);
+        default:
+            return useCache ? flush_block_cache() : sync_software_disk();
+    }
+}
+
+//Waits until the given number of nanoseconds after start.
+void waitUntil(double start, uint64_t nanoseconds) {
+    double delay = start + nanoseconds / 1e9 - now();
+    struct timespec ts;
+
+    if (delay <= 0)
+        return;
+    ts.tv_sec = (time_t)delay;
+    ts.tv_nsec = (long)((delay - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+//Counts a request for the given number of blocks that took the given time.
+void addRequest(ReplayTotals *totals, unsigned long blocks, double seconds) {
+    totals->requests++;
+    totals->blocks += blocks;
+    totals->seconds += seconds;
+    if (seconds > totals->maxSeconds)
+        totals->maxSeconds = seconds;
+}
+
+//Prints one member of a JSON object of totals, after a comma unless it is the first.
+void printTotals(const char *name, ReplayTotals *totals, int first) {
+    printf("%s    \"%s\": {\"requests\": %lu, \"blocks\": %lu, \"mean_us\": %.2f, \"max_us\": %.2f}",
+           first ? "" : ",\n", name, totals->requests, totals->blocks,
+           totals->requests ? totals->seconds * 1e6 / totals->requests : 0.0, totals->maxSeconds * 1e6);
+}
+
+int main(int argc, char *argv[]) {
+    SDTraceRecord *records;
+    ReplayTotals ops[SD_TRACE_SYNC + 1], *callers;
+    SDStats disk;
+    unsigned long numBlocks, cacheBlocks = 0, blocks = 0;
+    long numRecords;
+    unsigned char *buf;
+    char name[16];
+    double start, opStart, seconds, tracedSeconds;
+    int opt, timed = 0, first = 1;
+
+    while ((opt = getopt(argc, argv, "tc:")) != -1) {
+        switch (opt) {
+            case 't': timed = 1; break;
+            case 'c': cacheBlocks = strtoul(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [-t] [-c cacheblocks] tracefile\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-t] [-c cacheblocks] tracefile\n", argv[0]);
+        return 1;
+    }
+
+    numRecords = readTrace(argv[optind], &records, &numBlocks);
+    if (numRecords < 0)
+        return 1;
+    if (!init_software_disk_blocks(numBlocks ? numBlocks : 1)) {
+        sd_print_error();
+        return 1;
+    }
+    if (cacheBlocks && !init_block_cache(cacheBlocks)) {
+        fprintf(stderr, "sdreplay: can't make a block cache of %lu blocks\n", cacheBlocks);
+        return 1;
+    }
+    buf = calloc(SD_TRACE_MAX_BLOCKS, SOFTWARE_DISK_BLOCK_SIZE);
+    callers = calloc(MAX_CALLERS, sizeof(ReplayTotals));
+    if (!buf || !callers) {
+        fprintf(stderr, "sdreplay: out of memory\n");
+        return 1;
+    }
+    bzero(ops, sizeof(ops));
+
+    reset_sd_stats();
+    start = now();
+    for (long i = 0; i < numRecords; i++) {
+        if (timed)
+            waitUntil(start, records[i].nanoseconds - records[0].nanoseconds);
+        opStart = now();
+        if (!replayRecord(&records[i], buf, cacheBlocks != 0)) {
+            fprintf(stderr, "sdreplay: record %ld (%s of %u blocks at %u) failed: ", i, opNames[records[i].op],
+                    records[i].count, records[i].blocknum);
+            sd_print_error();
+            return 1;
+        }
+        seconds = now() - opStart;
+        addRequest(&ops[records[i].op], records[i].count, seconds);
+        addRequest(&callers[records[i].caller], records[i].count, seconds);
+        blocks += records[i].count;
+    }
+    //Writes left in the cache are part of the cost of replaying
+    if (cacheBlocks && !flush_block_cache()) {
+        sd_print_error();
+        return 1;
+    }
+    seconds = now() - start;
+    tracedSeconds = numRecords ? (records[numRecords - 1].nanoseconds - records[0].nanoseconds) / 1e9 : 0;
+    get_sd_stats(&disk);
+
+    printf("{\n  \"config\": {\"trace\": \"%s\", \"records\": %ld, \"disk_blocks\": %lu, \"cache_blocks\": %lu, "
+           "\"timed\": %s, \"engine\": \"%s\"},\n", argv[optind], numRecords, numBlocks, cacheBlocks,
+           timed ? "true" : "false", sd_async_engine());
+    printf("  \"seconds\": %.6f, \"traced_seconds\": %.6f, \"requests_per_sec\": %.1f, \"mb_per_sec\": %.2f,\n",
+           seconds, tracedSeconds, seconds > 0 ? numRecords / seconds : 0.0,
+           seconds > 0 ? blocks * (double)SOFTWARE_DISK_BLOCK_SIZE / seconds / (1024 * 1024) : 0.0);
+    printf("  \"ops\": {\n");
+    for (int op = SD_TRACE_READ; op <= SD_TRACE_SYNC; op++)
+        printTotals(opNames[op], &ops[op], op == SD_TRACE_READ);
+    //Caller 0 is anything not tagged; the filesystem tags its requests with an FSOperation + 1
+    printf("\n  },\n  \"callers\": {\n");
+    for (int caller = 0; caller < MAX_CALLERS; caller++) {
+        if (callers[caller].requests == 0)
+            continue;
+        sprintf(name, "%d", caller);
+        printTotals(name, &callers[caller], first);
+        first = 0;
+    }
+    printf("\n  },\n  \"disk\": {\"reads\": %lu, \"writes\": %lu, \"blocks_read\": %lu, \"blocks_written\": %lu, "
+           "\"syncs\": %lu}\n}\n", disk.reads, disk.writes, disk.blocks_read, disk.blocks_written, disk.syncs);
+    free(buf);
+    free(callers);
+    free(records);
+    return 0;
+}
@@ -5,129 +5,988 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+#if defined(__linux__) && ! defined(SD_MMAP_BACKEND) && ! defined(SD_NO_IO_URING)
+#define SD_IO_URING
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 #include "softwaredisk.h"
 
-#define NUM_BLOCKS 5000
 #define BACKING_STORE "sdprivate.sd"
 
+// most iovecs handed to a single preadv/pwritev call
+#define MAX_IOVECS 1024
+
+// trace records buffered before they are written to the trace file
+#define TRACE_BUFFER_RECORDS 4096
+
 // internals of software disk implementation
 typedef struct SoftwareDiskInternals {
-  FILE *fp;       
+  int fd;
+  int ready;                 // backing store open, read without sd_lock
+  unsigned long numblocks;   // size of the open backing store
+#ifdef SD_MMAP_BACKEND
+  unsigned char *map;   // the whole backing store, numblocks blocks
+#endif
 } SoftwareDiskInternals;
 
+// block I/O trace being recorded
+typedef struct SDTrace {
+  int active;                // recording, read without trace_lock
+  int fd;
+  int failed;                // a write to the trace file failed
+  int exit_registered;       // stop_trace_at_exit() is registered
+  struct timespec start;
+  uint32_t numrecords;       // records written to the trace file so far
+  unsigned long numbuffered;
+  SDTraceRecord records[TRACE_BUFFER_RECORDS];
+} SDTrace;
+
 //
 // GLOBALS
 //
 
-static SoftwareDiskInternals sd;
+static SoftwareDiskInternals sd = { .fd = -1 };
 
-// software disk error code set (set by each software disk function).
-SDError sderror;
+// serializes opening and creating the backing store; transfers on an open
+// store use positional I/O and need no lock
+static pthread_mutex_t sd_lock=PTHREAD_MUTEX_INITIALIZER;
 
+// counters, updated atomically by every thread
+static SDStats sd_stats;
 
-// initializes the software disk to all zeros, destroying any existing
-// data.  Returns 1 on success, otherwise 0. Always sets global 'sderror'.
-int init_software_disk() {
+// the trace, with its records buffered in order under trace_lock
+static SDTrace trace = { .fd = -1 };
+static pthread_mutex_t trace_lock=PTHREAD_MUTEX_INITIALIZER;
+
+// trace tag of the requests each thread makes
+static __thread unsigned char trace_caller;
+
+// software disk error code set (set by each software disk function in the
+// calling thread).
+__thread SDError sderror;
+
+// writes the buffered trace records to the trace file.  The caller holds
+// trace_lock.
+static void flush_trace(void) {
+  unsigned long size=trace.numbuffered * sizeof(SDTraceRecord);
+
+  if (trace.numbuffered && write(trace.fd, trace.records, size) != (ssize_t)size) {
+    trace.failed=1;
+  }
+  trace.numrecords += trace.numbuffered;
+  trace.numbuffered=0;
+}
+
+// records a request for 'count' blocks starting at 'blocknum', split into
+// records of at most SD_TRACE_MAX_BLOCKS blocks.
+static void trace_request(SDTraceOp op, unsigned long blocknum, unsigned long count) {
+  struct timespec now;
+  SDTraceRecord *record;
+
+  pthread_mutex_lock(&trace_lock);
+  if (trace.active) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    do {
+      if (trace.numbuffered == TRACE_BUFFER_RECORDS) {
+        flush_trace();
+      }
+      record=&trace.records[trace.numbuffered++];
+      record->nanoseconds=(uint64_t)(now.tv_sec - trace.start.tv_sec) * 1000000000
+	+ now.tv_nsec - trace.start.tv_nsec;
+      record->blocknum=blocknum;
+      record->count=count < SD_TRACE_MAX_BLOCKS ? count : SD_TRACE_MAX_BLOCKS;
+      record->op=op;
+      record->caller=trace_caller;
+      blocknum += record->count;
+      count -= record->count;
+    } while (count > 0);
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+// counts one request for 'count' blocks starting at 'blocknum', and traces it
+// if a trace is being recorded.
+static void count_request(int writing, unsigned long blocknum, unsigned long count) {
+  if (writing) {
+    __atomic_fetch_add(&sd_stats.writes, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sd_stats.blocks_written, count, __ATOMIC_RELAXED);
+  }
+  else {
+    __atomic_fetch_add(&sd_stats.reads, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sd_stats.blocks_read, count, __ATOMIC_RELAXED);
+  }
+  if (__atomic_load_n(&trace.active, __ATOMIC_RELAXED)) {
+    trace_request(writing ? SD_TRACE_WRITE : SD_TRACE_READ, blocknum, count);
+  }
+}
+
+// creates an empty backing store and extends it to 'numblocks' blocks with
+// ftruncate.  The file is sparse: nothing is written, and every block reads
+// as zeros until it is first written, so this takes the same time whatever
+// the size of the disk.
+static int create_backing_file(unsigned long numblocks) {
+  if (sd.fd >= 0) {
+    close(sd.fd);
+  }
+  sd.numblocks=0;
+  sd.fd=open(BACKING_STORE, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (sd.fd < 0) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  if (ftruncate(sd.fd, (off_t)numblocks * SOFTWARE_DISK_BLOCK_SIZE) != 0) {
+    close(sd.fd);
+    sd.fd=-1;
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  sd.numblocks=numblocks;
+  return 1;
+}
+
+static int open_backing_file(void) {
+  struct stat st;
+
+  sd.fd=open(BACKING_STORE, O_RDWR);
+  if (sd.fd < 0) {             
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  // the disk is as large as the backing store, which must be a whole number
+  // of blocks
+  if (fstat(sd.fd, &st) != 0 || st.st_size == 0 || st.st_size % SOFTWARE_DISK_BLOCK_SIZE != 0) {
+    close(sd.fd);
+    sd.fd=-1;
+    sderror=SD_NOT_INIT;
+    return 0;
+  }
+  sd.numblocks=st.st_size / SOFTWARE_DISK_BLOCK_SIZE;
+  return 1;
+}
+
+#ifdef SD_MMAP_BACKEND
+
+//
+// mmap backend: the backing store is mapped once and blocks are copied
+// to and from the mapping.
+//
+
+static int map_backing_store(void) {
+  sd.map=mmap(NULL, sd.numblocks * SOFTWARE_DISK_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+	      MAP_SHARED, sd.fd, 0);
+  if (sd.map == MAP_FAILED) {
+    sd.map=NULL;
+    close(sd.fd);
+    sd.fd=-1;
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  return 1;
+}
+
+static int create_backing_store(unsigned long numblocks) {
+  if (sd.map) {
+    munmap(sd.map, sd.numblocks * SOFTWARE_DISK_BLOCK_SIZE);
+    sd.map=NULL;
+  }
+  if (! create_backing_file(numblocks)) {
+    return 0;
+  }
+  return map_backing_store();
+}
+
+static int open_backing_store(void) {
+  if (sd.map) {
+    return 1;
+  }
+  return open_backing_file() && map_backing_store();
+}
+
+// copies the blocks starting at 'blocknum' to or from the buffers in 'iov'.
+static int store_transfer(int writing, unsigned long blocknum, struct iovec *iov, int iovcnt) {
+  unsigned char *p=sd.map + blocknum * SOFTWARE_DISK_BLOCK_SIZE;
   int i;
-  char block[SOFTWARE_DISK_BLOCK_SIZE];
-  sderror=SD_NONE;
-  sd.fp=fopen(BACKING_STORE, "w+");
-  if (! sd.fp) {
+
+  for (i=0; i < iovcnt; i++) {
+    if (writing) {
+      memcpy(p, iov[i].iov_base, iov[i].iov_len);
+    }
+    else {
+      memcpy(iov[i].iov_base, p, iov[i].iov_len);
+    }
+    p += iov[i].iov_len;
+  }
+  return 1;
+}
+
+static int store_sync(void) {
+  if (msync(sd.map, sd.numblocks * SOFTWARE_DISK_BLOCK_SIZE, MS_SYNC) != 0) {
     sderror=SD_INTERNAL_ERROR;
     return 0;
   }
-  
-  bzero(block, SOFTWARE_DISK_BLOCK_SIZE);
-  for (i=0; i < NUM_BLOCKS; i++) {
-    if (fwrite(block, SOFTWARE_DISK_BLOCK_SIZE, 1, sd.fp) != 1) {
-      fclose(sd.fp);
-      sd.fp=NULL;
+  return 1;
+}
+
+#else
+
+//
+// file descriptor backend: runs of blocks are a single preadv/pwritev
+// on the backing store.
+//
+
+static int create_backing_store(unsigned long numblocks) {
+
+  return create_backing_file(numblocks);
+}
+
+static int open_backing_store(void) {
+  if (sd.fd >= 0) {
+    return 1;
+  }
+  return open_backing_file();
+}
+
+// transfers the blocks starting at 'blocknum' to or from the buffers in
+// 'iov', resubmitting after short transfers.  'iov' may be modified.
+static int store_transfer(int writing, unsigned long blocknum, struct iovec *iov, int iovcnt) {
+  off_t offset=(off_t)blocknum * SOFTWARE_DISK_BLOCK_SIZE;
+  ssize_t done;
+
+  while (iovcnt > 0) {
+    if (writing) {
+      done=pwritev(sd.fd, iov, iovcnt, offset);
+    }
+    else {
+      done=preadv(sd.fd, iov, iovcnt, offset);
+    }
+    if (done <= 0) {
       sderror=SD_INTERNAL_ERROR;
       return 0;
     }
+    offset += done;
+    while (iovcnt > 0 && (size_t)done >= iov->iov_len) {
+      done -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base=(char *)iov->iov_base + done;
+      iov->iov_len -= done;
+    }
   }
   return 1;
 }
 
-// returns the size of the SoftwareDisk in multiples of SOFTWARE_DISK_BLOCK_SIZE
-unsigned long software_disk_size() {
+static int store_sync(void) {
+  if (fdatasync(sd.fd) != 0) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  return 1;
+}
 
-  return NUM_BLOCKS;
+#endif
+
+// opens the backing store the first time any thread needs it.
+static int ensure_backing_store(void) {
+  int ret;
+
+  if (__atomic_load_n(&sd.ready, __ATOMIC_ACQUIRE)) {
+    return 1;
+  }
+  pthread_mutex_lock(&sd_lock);
+  ret=open_backing_store();
+  if (ret) {
+    __atomic_store_n(&sd.ready, 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&sd_lock);
+  return ret;
 }
 
-// writes a block of data from 'buf' at location 'blocknum'.  Blocks are numbered 
-// from 0.  The buffer 'buf' must be of size SOFTWARE_DISK_BLOCK_SIZE.  Returns 1
-// on success or 0 on failure.  Always sets global 'sderror'.
-int write_sd_block(void *buf, unsigned long blocknum) {
+//
+// asynchronous requests.  The file descriptor backend hands them to io_uring
+// when the kernel supports it, and otherwise to a pool of worker threads
+// making the same positional transfers.  The mmap backend carries them out
+// as they are submitted.
+//
 
-  sderror=SD_NONE;
-  if (! sd.fp) {
-    sd.fp=fopen(BACKING_STORE, "r+");
-    if (! sd.fp) {             
-      sderror=SD_INTERNAL_ERROR;
+// largest single request, so its byte count fits the kernel's 32-bit length
+#define MAX_REQUEST_BLOCKS ((1UL << 30) / SOFTWARE_DISK_BLOCK_SIZE)
+
+static int request_complete(SDRequest *req, SDError error) {
+  req->error=error;
+  __atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+  return error == SD_NONE;
+}
+
+#ifdef SD_MMAP_BACKEND
+
+static const char *engine_name(void) {
+  return "sync";
+}
+
+static void engine_submit(SDRequest *reqs, unsigned long count) {
+  struct iovec iov;
+  unsigned long i;
+
+  for (i=0; i < count; i++) {
+    iov.iov_base=reqs[i].buf;
+    iov.iov_len=reqs[i].count * SOFTWARE_DISK_BLOCK_SIZE;
+    request_complete(&reqs[i], store_transfer(reqs[i].writing, reqs[i].blocknum, &iov, 1) ? SD_NONE : sderror);
+  }
+}
+
+static void engine_wait(SDRequest *reqs, unsigned long count) {
+  (void)reqs;
+  (void)count;
+}
+
+#else
+
+#define NUM_WORKERS 4           // worker threads when io_uring isn't available
+#define RING_ENTRIES 256        // io_uring submission queue size
+
+// internals of the asynchronous engine
+typedef struct AsyncEngine {
+  pthread_mutex_t lock;
+  pthread_cond_t completed;     // broadcast whenever requests complete
+  // worker pool
+  pthread_cond_t queued;
+  SDRequest *head, *tail;       // requests waiting for a worker
+  // io_uring
+  int ring_fd;                  // -1 when the worker pool is in use
+  int reaping;                  // a waiter owns the completion ring
+  unsigned pending;             // queued entries not yet handed to the kernel
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  void *sqes;
+  void *cqes;
+} AsyncEngine;
+
+static AsyncEngine engine = { .lock = PTHREAD_MUTEX_INITIALIZER,
+			      .completed = PTHREAD_COND_INITIALIZER,
+			      .queued = PTHREAD_COND_INITIALIZER,
+			      .ring_fd = -1 };
+
+static pthread_once_t engine_once=PTHREAD_ONCE_INIT;
+
+static int requests_done(SDRequest *reqs, unsigned long count) {
+  unsigned long i;
+
+  for (i=0; i < count; i++) {
+    if (! __atomic_load_n(&reqs[i].done, __ATOMIC_ACQUIRE)) {
       return 0;
     }
+  }
+  return 1;
+}
+
+static void *engine_worker(void *arg) {
+  SDRequest *req;
+  struct iovec iov;
+  int ok;
+
+  (void)arg;
+  pthread_mutex_lock(&engine.lock);
+  for (;;) {
+    while (! engine.head) {
+      pthread_cond_wait(&engine.queued, &engine.lock);
+    }
+    req=engine.head;
+    engine.head=req->next;
+    if (! engine.head) {
+      engine.tail=NULL;
+    }
+    pthread_mutex_unlock(&engine.lock);
+
+    iov.iov_base=req->buf;
+    iov.iov_len=req->count * SOFTWARE_DISK_BLOCK_SIZE;
+    ok=store_transfer(req->writing, req->blocknum, &iov, 1);
+
+    pthread_mutex_lock(&engine.lock);
+    request_complete(req, ok ? SD_NONE : sderror);
+    pthread_cond_broadcast(&engine.completed);
+  }
+  return NULL;
+}
+
+static void start_workers(void) {
+  pthread_t thread;
+  int i;
+
+  for (i=0; i < NUM_WORKERS; i++) {
+    if (pthread_create(&thread, NULL, engine_worker, NULL) == 0) {
+      pthread_detach(thread);
+    }
+  }
+}
+
+#ifdef SD_IO_URING
+
+static int ring_enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+  int ret;
+
+  do {
+    ret=syscall(__NR_io_uring_enter, engine.ring_fd, to_submit, min_complete, flags, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+  return ret;
+}
+
+// hands every queued entry to the kernel.  Called with the engine lock held.
+static void ring_submit(void) {
+  int ret;
+
+  while (engine.pending > 0) {
+    ret=ring_enter(engine.pending, 0, 0);
+    if (ret <= 0) {
+      // the kernel takes entries it can't start as failed completions,
+      // so this only happens if the ring itself is broken
+      break;
+    }
+    engine.pending -= ret;
+  }
+}
+
+// queues the rest of 'req' on the submission ring.  Called with the engine
+// lock held.
+static void ring_queue(SDRequest *req) {
+  struct io_uring_sqe *sqe;
+  unsigned tail=*engine.sq_tail, index;
+  unsigned long total=req->count * SOFTWARE_DISK_BLOCK_SIZE;
+
+  if (tail - __atomic_load_n(engine.sq_head, __ATOMIC_ACQUIRE) == *engine.sq_entries) {
+    ring_submit();
+  }
+  index=tail & *engine.sq_mask;
+  sqe=(struct io_uring_sqe *)engine.sqes + index;
+  bzero(sqe, sizeof(*sqe));
+  sqe->opcode=req->writing ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd=sd.fd;
+  sqe->addr=(unsigned long)req->buf + req->progress;
+  sqe->len=total - req->progress;
+  sqe->off=(unsigned long long)req->blocknum * SOFTWARE_DISK_BLOCK_SIZE + req->progress;
+  sqe->user_data=(unsigned long)req;
+  engine.sq_array[index]=index;
+  __atomic_store_n(engine.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  engine.pending++;
+}
+
+// takes every completion off the ring, resubmitting short transfers.  Called
+// with the engine lock held by the waiter that owns the ring.
+static void ring_reap(void) {
+  struct io_uring_cqe *cqe;
+  SDRequest *req;
+  unsigned head=*engine.cq_head;
+  int reaped=0;
+
+  while (head != __atomic_load_n(engine.cq_tail, __ATOMIC_ACQUIRE)) {
+    cqe=(struct io_uring_cqe *)engine.cqes + (head & *engine.cq_mask);
+    req=(SDRequest *)(unsigned long)cqe->user_data;
+    if (cqe->res <= 0) {
+      request_complete(req, SD_INTERNAL_ERROR);
+    }
+    else {
+      req->progress += cqe->res;
+      if (req->progress < req->count * SOFTWARE_DISK_BLOCK_SIZE) {
+	ring_queue(req);
+      }
+      else {
+	request_complete(req, SD_NONE);
+      }
+    }
+    head++;
+    reaped=1;
+  }
+  __atomic_store_n(engine.cq_head, head, __ATOMIC_RELEASE);
+  ring_submit();
+  if (reaped) {
+    pthread_cond_broadcast(&engine.completed);
+  }
+}
+
+// sets up an io_uring instance, returning 0 if the kernel doesn't support
+// one with read and write operations.
+static int ring_setup(void) {
+  struct io_uring_params p;
+  struct io_uring_probe *probe;
+  size_t sq_size, cq_size;
+  unsigned char *sq, *cq;
+  void *sqes;
+  int fd, ok;
+
+  bzero(&p, sizeof(p));
+  fd=syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+  if (fd < 0) {
+    return 0;
+  }
+  probe=calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+  ok=probe && syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0
+    && probe->last_op >= IORING_OP_WRITE
+    && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+    && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  if (! ok) {
+    close(fd);
+    return 0;
+  }
+
+  sq_size=p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size=p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_size=cq_size=sq_size > cq_size ? sq_size : cq_size;
+  }
+  sq=mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  cq=(p.features & IORING_FEAT_SINGLE_MMAP) ? sq :
+    mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  sqes=mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+    close(fd);
+    return 0;
+  }
+
+  engine.sq_head=(unsigned *)(sq + p.sq_off.head);
+  engine.sq_tail=(unsigned *)(sq + p.sq_off.tail);
+  engine.sq_mask=(unsigned *)(sq + p.sq_off.ring_mask);
+  engine.sq_entries=(unsigned *)(sq + p.sq_off.ring_entries);
+  engine.sq_array=(unsigned *)(sq + p.sq_off.array);
+  engine.cq_head=(unsigned *)(cq + p.cq_off.head);
+  engine.cq_tail=(unsigned *)(cq + p.cq_off.tail);
+  engine.cq_mask=(unsigned *)(cq + p.cq_off.ring_mask);
+  engine.cqes=cq + p.cq_off.cqes;
+  engine.sqes=sqes;
+  engine.ring_fd=fd;
+  return 1;
+}
+
+#endif
+
+static void start_engine(void) {
+#ifdef SD_IO_URING
+  if (ring_setup()) {
+    return;
+  }
+#endif
+  start_workers();
+}
+
+static const char *engine_name(void) {
+  pthread_once(&engine_once, start_engine);
+  return engine.ring_fd >= 0 ? "io_uring" : "threads";
+}
+
+static void engine_submit(SDRequest *reqs, unsigned long count) {
+  unsigned long i;
+
+  pthread_once(&engine_once, start_engine);
+  pthread_mutex_lock(&engine.lock);
+  for (i=0; i < count; i++) {
+#ifdef SD_IO_URING
+    if (engine.ring_fd >= 0) {
+      ring_queue(&reqs[i]);
+      continue;
+    }
+#endif
+    reqs[i].next=NULL;
+    if (engine.tail) {
+      engine.tail->next=&reqs[i];
+    }
     else {
-      fseek(sd.fp, 0L, SEEK_END);
-      if (ftell(sd.fp) != NUM_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE) {
-	fclose(sd.fp);
-	sd.fp=0;
-	sderror=SD_NOT_INIT;
-	return 0;
+      engine.head=&reqs[i];
+    }
+    engine.tail=&reqs[i];
+  }
+#ifdef SD_IO_URING
+  if (engine.ring_fd >= 0) {
+    ring_submit();
+  }
+  else
+#endif
+  pthread_cond_broadcast(&engine.queued);
+  pthread_mutex_unlock(&engine.lock);
+}
+
+static void engine_wait(SDRequest *reqs, unsigned long count) {
+  pthread_mutex_lock(&engine.lock);
+  while (! requests_done(reqs, count)) {
+#ifdef SD_IO_URING
+    // one waiter at a time takes completions off the ring and blocks in the
+    // kernel for more, until its own requests are done.  Nobody else reaps
+    // meanwhile, so a completion it waits for is either still in flight or
+    // on the ring, where it ends the wait at once.  The rest wait for it to
+    // reap theirs, and one of them takes over when it is done.
+    if (engine.ring_fd >= 0 && ! engine.reaping) {
+      engine.reaping=1;
+      ring_reap();
+      while (! requests_done(reqs, count)) {
+	pthread_mutex_unlock(&engine.lock);
+	ring_enter(0, 1, IORING_ENTER_GETEVENTS);
+	pthread_mutex_lock(&engine.lock);
+	ring_reap();
       }
+      engine.reaping=0;
+      pthread_cond_broadcast(&engine.completed);
+      break;
     }
+#endif
+    pthread_cond_wait(&engine.completed, &engine.lock);
   }
+  pthread_mutex_unlock(&engine.lock);
+}
 
-  if (blocknum > NUM_BLOCKS-1) {
+#endif
+
+// transfers 'count' consecutive blocks starting at 'blocknum' to or from the
+// contiguous buffer 'buf'.
+static int transfer_run(int writing, void *buf, unsigned long blocknum, unsigned long count) {
+  struct iovec iov;
+
+  sderror=SD_NONE;
+  if (! ensure_backing_store()) {
+    return 0;
+  }
+
+  if (blocknum > sd.numblocks-1 || count > sd.numblocks - blocknum) {
     sderror=SD_ILLEGAL_BLOCK_NUMBER;
     return 0;
   }
 
-  fseek(sd.fp, blocknum * SOFTWARE_DISK_BLOCK_SIZE, SEEK_SET);
-  if (fwrite(buf, SOFTWARE_DISK_BLOCK_SIZE, 1, sd.fp) != 1) {
+  if (count == 0) {
+    return 1;
+  }
+  iov.iov_base=buf;
+  iov.iov_len=count * SOFTWARE_DISK_BLOCK_SIZE;
+  count_request(writing, blocknum, count);
+  return store_transfer(writing, blocknum, &iov, 1);
+}
+
+// a block to transfer, sorted by block number
+typedef struct BlockRequest {
+  unsigned long blocknum;
+  void *buf;
+} BlockRequest;
+
+static int compare_by_blocknum(const void *a, const void *b) {
+  unsigned long x=((const BlockRequest *)a)->blocknum;
+  unsigned long y=((const BlockRequest *)b)->blocknum;
+  return (x > y) - (x < y);
+}
+
+// transfers block 'blocknums[i]' to or from 'bufs[i]' for each i, issuing
+// one transfer per run of consecutive block numbers.
+static int transfer_scattered(int writing, void **bufs, unsigned long *blocknums, unsigned long count) {
+  struct iovec iov[MAX_IOVECS];
+  BlockRequest *order;
+  unsigned long i, start;
+  int n;
+
+  sderror=SD_NONE;
+  if (! ensure_backing_store()) {
+    return 0;
+  }
+
+  for (i=0; i < count; i++) {
+    if (blocknums[i] > sd.numblocks-1) {
+      sderror=SD_ILLEGAL_BLOCK_NUMBER;
+      return 0;
+    }
+  }
+
+  order=malloc(count * sizeof(BlockRequest));
+  if (count && ! order) {
     sderror=SD_INTERNAL_ERROR;
     return 0;
   }
-  fflush(sd.fp);
+  for (i=0; i < count; i++) {
+    order[i].blocknum=blocknums[i];
+    order[i].buf=bufs[i];
+  }
+  qsort(order, count, sizeof(BlockRequest), compare_by_blocknum);
+
+  i=0;
+  while (i < count) {
+    start=order[i].blocknum;
+    n=0;
+    do {
+      iov[n].iov_base=order[i].buf;
+      iov[n].iov_len=SOFTWARE_DISK_BLOCK_SIZE;
+      n++;
+      i++;
+    } while (i < count && n < MAX_IOVECS && order[i].blocknum == start + n);
+    count_request(writing, start, n);
+    if (! store_transfer(writing, start, iov, n)) {
+      free(order);
+      return 0;
+    }
+  }
+  free(order);
   return 1;
 }
 
+// initializes the software disk to all zeros, destroying any existing
+// data.  Returns 1 on success, otherwise 0. Always sets global 'sderror'.
+int init_software_disk() {
+
+  return init_software_disk_blocks(SOFTWARE_DISK_DEFAULT_BLOCKS);
+}
+
+// initializes a software disk of 'numblocks' blocks to all zeros, destroying
+// any existing data.  Returns 1 on success, otherwise 0. Always sets global
+// 'sderror'.
+int init_software_disk_blocks(unsigned long numblocks) {
+  int ret;
+
+  sderror=SD_NONE;
+  if (numblocks == 0 || numblocks > SOFTWARE_DISK_MAX_BLOCKS) {
+    sderror=SD_ILLEGAL_BLOCK_NUMBER;
+    return 0;
+  }
+  pthread_mutex_lock(&sd_lock);
+  __atomic_store_n(&sd.ready, 0, __ATOMIC_RELEASE);
+  ret=create_backing_store(numblocks);
+  if (ret) {
+    __atomic_store_n(&sd.ready, 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&sd_lock);
+  return ret;
+}
+
+// returns the size of the SoftwareDisk in multiples of SOFTWARE_DISK_BLOCK_SIZE,
+// taken from the backing store, or 0 if the software disk isn't initialized
+unsigned long software_disk_size() {
+
+  if (! ensure_backing_store()) {
+    return 0;
+  }
+  return sd.numblocks;
+}
+
+// writes a block of data from 'buf' at location 'blocknum'.  Blocks are numbered 
+// from 0.  The buffer 'buf' must be of size SOFTWARE_DISK_BLOCK_SIZE.  Returns 1
+// on success or 0 on failure.  Always sets global 'sderror'.
+int write_sd_block(void *buf, unsigned long blocknum) {
+
+  return transfer_run(1, buf, blocknum, 1);
+}
+
 // reads a block of data into 'buf' from location 'blocknum'.  Blocks are numbered 
 // from 0.  The buffer 'buf' must be of size SOFTWARE_DISK_BLOCK_SIZE.  Returns 1
 // on success or 0 on failure.  Always sets global 'sderror'.
 int read_sd_block(void *buf, unsigned long blocknum) {
 
+  return transfer_run(0, buf, blocknum, 1);
+}
+
+// writes 'count' consecutive blocks from 'buf', starting at location 'blocknum'.
+// The buffer 'buf' must be of size count * SOFTWARE_DISK_BLOCK_SIZE.  Returns 1
+// on success or 0 on failure.  Always sets global 'sderror'.
+int write_sd_blocks(void *buf, unsigned long blocknum, unsigned long count) {
+
+  return transfer_run(1, buf, blocknum, count);
+}
+
+// reads 'count' consecutive blocks into 'buf', starting at location 'blocknum'.
+// The buffer 'buf' must be of size count * SOFTWARE_DISK_BLOCK_SIZE.  Returns 1
+// on success or 0 on failure.  Always sets global 'sderror'.
+int read_sd_blocks(void *buf, unsigned long blocknum, unsigned long count) {
+
+  return transfer_run(0, buf, blocknum, count);
+}
+
+// writes each 'bufs[i]' to location 'blocknums[i]', for i < 'count'.  Runs of
+// consecutive block numbers are written together.  Returns 1 on success or 0 on
+// failure.  Always sets global 'sderror'.
+int writev_sd_blocks(void **bufs, unsigned long *blocknums, unsigned long count) {
+
+  return transfer_scattered(1, bufs, blocknums, count);
+}
+
+// reads location 'blocknums[i]' into each 'bufs[i]', for i < 'count'.  Runs of
+// consecutive block numbers are read together.  Returns 1 on success or 0 on
+// failure.  Always sets global 'sderror'.
+int readv_sd_blocks(void **bufs, unsigned long *blocknums, unsigned long count) {
+
+  return transfer_scattered(0, bufs, blocknums, count);
+}
+
+// submits 'count' asynchronous requests and returns without waiting for
+// them.  Returns 1 if every request was submitted, or 0 without submitting
+// any if one is out of range.  Always sets global 'sderror'.
+int submit_sd_requests(SDRequest *reqs, unsigned long count) {
+  unsigned long i;
+
   sderror=SD_NONE;
-  if (! sd.fp) {
-    sd.fp=fopen(BACKING_STORE, "r+");
-    if (! sd.fp) {             
-      sderror=SD_INTERNAL_ERROR;
+  if (! ensure_backing_store()) {
+    return 0;
+  }
+
+  for (i=0; i < count; i++) {
+    if (reqs[i].count == 0 || reqs[i].count > MAX_REQUEST_BLOCKS || reqs[i].blocknum > sd.numblocks-1
+	|| reqs[i].count > sd.numblocks - reqs[i].blocknum) {
+      sderror=SD_ILLEGAL_BLOCK_NUMBER;
       return 0;
     }
-    else {
-      fseek(sd.fp, 0L, SEEK_END);
-      if (ftell(sd.fp) != NUM_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE) {
-	fclose(sd.fp);
-	sd.fp=0;
-	sderror=SD_NOT_INIT;
-	return 0;
-      }
+  }
+  for (i=0; i < count; i++) {
+    reqs[i].done=0;
+    reqs[i].error=SD_NONE;
+    reqs[i].progress=0;
+    count_request(reqs[i].writing, reqs[i].blocknum, reqs[i].count);
+  }
+  engine_submit(reqs, count);
+  return 1;
+}
+
+// waits for 'count' submitted requests to complete.  Returns 1 if they all
+// succeeded or 0 if any failed.  Always sets global 'sderror'.
+int wait_sd_requests(SDRequest *reqs, unsigned long count) {
+  unsigned long i;
+
+  sderror=SD_NONE;
+  engine_wait(reqs, count);
+  for (i=0; i < count; i++) {
+    if (reqs[i].error != SD_NONE) {
+      sderror=reqs[i].error;
+      return 0;
     }
   }
+  return 1;
+}
 
-  if (blocknum > NUM_BLOCKS-1) {
-    sderror=SD_ILLEGAL_BLOCK_NUMBER;
+// returns the name of the engine carrying out asynchronous requests.
+const char *sd_async_engine(void) {
+
+  return engine_name();
+}
+
+// forces every block written so far out to the backing store.  Returns 1
+// on success or 0 on failure.  Always sets global 'sderror'.
+int sync_software_disk(void) {
+
+  sderror=SD_NONE;
+  if (! ensure_backing_store()) {
     return 0;
   }
 
-  fseek(sd.fp, blocknum * SOFTWARE_DISK_BLOCK_SIZE, SEEK_SET);
-  if (fread(buf, SOFTWARE_DISK_BLOCK_SIZE, 1, sd.fp) != 1) {
+  __atomic_fetch_add(&sd_stats.syncs, 1, __ATOMIC_RELAXED);
+  if (__atomic_load_n(&trace.active, __ATOMIC_RELAXED)) {
+    trace_request(SD_TRACE_SYNC, 0, 0);
+  }
+  return store_sync();
+}
+
+// copies the current software disk counters into 'stats'.
+void get_sd_stats(SDStats *stats) {
+  stats->reads=__atomic_load_n(&sd_stats.reads, __ATOMIC_RELAXED);
+  stats->writes=__atomic_load_n(&sd_stats.writes, __ATOMIC_RELAXED);
+  stats->blocks_read=__atomic_load_n(&sd_stats.blocks_read, __ATOMIC_RELAXED);
+  stats->blocks_written=__atomic_load_n(&sd_stats.blocks_written, __ATOMIC_RELAXED);
+  stats->syncs=__atomic_load_n(&sd_stats.syncs, __ATOMIC_RELAXED);
+}
+
+// zeroes the software disk counters.
+void reset_sd_stats(void) {
+  __atomic_store_n(&sd_stats.reads, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&sd_stats.writes, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&sd_stats.blocks_read, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&sd_stats.blocks_written, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&sd_stats.syncs, 0, __ATOMIC_RELAXED);
+}
+
+// stops the trace and completes its header.  The caller holds trace_lock.
+static int stop_trace_locked(void) {
+  SDTraceHeader header;
+
+  if (! trace.active) {
+    return 1;
+  }
+  __atomic_store_n(&trace.active, 0, __ATOMIC_RELAXED);
+  flush_trace();
+  header.magic=SD_TRACE_MAGIC;
+  header.block_size=SOFTWARE_DISK_BLOCK_SIZE;
+  header.numblocks=__atomic_load_n(&sd.ready, __ATOMIC_ACQUIRE) ? sd.numblocks : 0;
+  header.numrecords=trace.numrecords;
+  if (pwrite(trace.fd, &header, sizeof(header), 0) != sizeof(header)) {
+    trace.failed=1;
+  }
+  if (close(trace.fd) < 0) {
+    trace.failed=1;
+  }
+  trace.fd=-1;
+  return ! trace.failed;
+}
+
+static void stop_trace_at_exit(void) {
+  pthread_mutex_lock(&trace_lock);
+  stop_trace_locked();
+  pthread_mutex_unlock(&trace_lock);
+}
+
+// starts recording every request made of the backing store to the trace file
+// 'path'.  Returns 1 on success or 0 on failure.  Always sets global
+// 'sderror'.
+int start_sd_trace(const char *path) {
+  SDTraceHeader header;
+  int ret=1;
+
+  sderror=SD_NONE;
+  pthread_mutex_lock(&trace_lock);
+  stop_trace_locked();
+  trace.fd=open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  //the header is filled in when the trace stops
+  bzero(&header, sizeof(header));
+  if (trace.fd < 0 || write(trace.fd, &header, sizeof(header)) != sizeof(header)) {
+    if (trace.fd >= 0) {
+      close(trace.fd);
+    }
+    trace.fd=-1;
     sderror=SD_INTERNAL_ERROR;
-    return 0;
+    ret=0;
   }
-  fflush(sd.fp);
-  return 1;
+  else {
+    trace.failed=0;
+    trace.numrecords=0;
+    trace.numbuffered=0;
+    clock_gettime(CLOCK_MONOTONIC, &trace.start);
+    if (! trace.exit_registered) {
+      atexit(stop_trace_at_exit);
+      trace.exit_registered=1;
+    }
+    __atomic_store_n(&trace.active, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&trace_lock);
+  return ret;
+}
+
+// stops recording and completes the trace file.  Returns 1 if every record
+// was written or 0 if writing the trace failed.  Always sets global 'sderror'.
+int stop_sd_trace(void) {
+  int ret;
+
+  sderror=SD_NONE;
+  pthread_mutex_lock(&trace_lock);
+  ret=stop_trace_locked();
+  pthread_mutex_unlock(&trace_lock);
+  if (! ret) {
+    sderror=SD_INTERNAL_ERROR;
+  }
+  return ret;
+}
+
+// tags the requests the calling thread makes from now on with 'caller'.
+void set_sd_trace_caller(unsigned int caller) {
+  trace_caller=caller;
 }
 
 // describe current software disk error code by printing a descriptive message to
@@ -152,4 +1011,4 @@ void sd_print_error(void) {
 }
 
 // software disk  error code set (set by each software disk function).
-SDError sderror;
+__thread SDError sderror;
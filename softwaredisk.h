@@ -3,8 +3,26 @@
 // Written by Golden G. Richard III (@nolaforensix), 10/2017.
 //
 
+#ifndef SOFTWAREDISK_H
+#define SOFTWAREDISK_H
+
+#include <stdint.h>
+
 #define SOFTWARE_DISK_BLOCK_SIZE 512
 
+// size of the disk created by init_software_disk(), in blocks
+#define SOFTWARE_DISK_DEFAULT_BLOCKS 5000
+
+// largest disk init_software_disk_blocks() will create, in blocks; block
+// numbers always fit in 32 bits
+#define SOFTWARE_DISK_MAX_BLOCKS 0x7fffffffUL
+
+// The software disk is backed by positional reads and writes on a file
+// descriptor by default.  Compiling softwaredisk.c with -DSD_MMAP_BACKEND maps
+// the backing store with mmap instead, so block reads and writes become memory
+// copies.  Block reads and writes may be issued from several threads at once;
+// initializing the disk must not overlap them.
+
 // software disk error codes
 typedef enum  {
   SD_NONE,
@@ -13,13 +31,75 @@ typedef enum  {
   SD_INTERNAL_ERROR          // the software disk has failed
 } SDError;
 
+// software disk counters, see get_sd_stats()
+typedef struct SDStats {
+  unsigned long reads;          // read requests made of the backing store
+  unsigned long writes;         // write requests made of the backing store
+  unsigned long blocks_read;
+  unsigned long blocks_written;
+  unsigned long syncs;          // sync_software_disk() calls
+} SDStats;
+
+// A block I/O trace, see start_sd_trace(), is an SDTraceHeader followed by
+// one SDTraceRecord per request made of the backing store, in the order they
+// were made, all in the byte order of the machine that recorded them.
+#define SD_TRACE_MAGIC 0x31544453    // "SDT1"
+
+// largest number of blocks in one trace record; longer requests are recorded
+// as several consecutive records
+#define SD_TRACE_MAX_BLOCKS 0xffff
+
+// what a trace record records
+typedef enum {
+  SD_TRACE_READ,
+  SD_TRACE_WRITE,
+  SD_TRACE_SYNC              // sync_software_disk(); blocknum and count are 0
+} SDTraceOp;
+
+typedef struct SDTraceHeader {
+  uint32_t magic;            // SD_TRACE_MAGIC
+  uint32_t block_size;       // SOFTWARE_DISK_BLOCK_SIZE
+  uint32_t numblocks;        // size of the software disk when the trace stopped
+  uint32_t numrecords;
+} SDTraceHeader;
+
+typedef struct SDTraceRecord {
+  uint64_t nanoseconds;      // when the request was made, since the trace started
+  uint32_t blocknum;
+  uint16_t count;
+  uint8_t op;                // an SDTraceOp
+  uint8_t caller;            // the requesting thread's set_sd_trace_caller() tag
+} SDTraceRecord;
+
+// an asynchronous transfer of 'count' consecutive blocks between 'buf' and the
+// software disk, starting at location 'blocknum'.  The caller fills in the
+// first four fields; the rest belong to the software disk until
+// wait_sd_requests() returns.
+typedef struct SDRequest {
+  int writing;               // 1 to write 'buf' to the disk, 0 to read into it
+  void *buf;                 // count * SOFTWARE_DISK_BLOCK_SIZE bytes
+  unsigned long blocknum;
+  unsigned long count;
+  int done;                  // set once the request has completed
+  SDError error;             // how it completed
+  unsigned long progress;    // bytes transferred so far
+  struct SDRequest *next;    // link in the engine's queue
+} SDRequest;
+
 // function prototypes for software disk API
 
 // initializes the software disk to all zeros, destroying any existing
 // data.  Returns 1 on success, otherwise 0. Always sets global 'sderror'.
 int init_software_disk();
 
-// returns the size of the SoftwareDisk in multiples of SOFTWARE_DISK_BLOCK_SIZE
+// initializes a software disk of 'numblocks' blocks to all zeros, destroying
+// any existing data.  Returns 1 on success, otherwise 0. Always sets global
+// 'sderror'.
+int init_software_disk_blocks(unsigned long numblocks);
+
+// returns the size of the SoftwareDisk in multiples of SOFTWARE_DISK_BLOCK_SIZE.
+// An existing disk is as large as its backing store.  Returns 0 if the
+// software disk hasn't been initialized.
 unsigned long software_disk_size();
 
 // writes a block of data from 'buf' at location 'blocknum'.  Blocks are numbered 
@@ -32,9 +112,82 @@ int write_sd_block(void *buf, unsigned long blocknum);
 // on success or 0 on failure.  Always sets global 'sderror'.
 int read_sd_block(void *buf, unsigned long blocknum);
 
+// writes 'count' consecutive blocks from 'buf', starting at location 'blocknum'.
+// The buffer 'buf' must be of size count * SOFTWARE_DISK_BLOCK_SIZE.  Returns 1
+// on success or 0 on failure.  Always sets global 'sderror'.
+int write_sd_blocks(void *buf, unsigned long blocknum, unsigned long count);
+
+// reads 'count' consecutive blocks into 'buf', starting at location 'blocknum'.
+// The buffer 'buf' must be of size count * SOFTWARE_DISK_BLOCK_SIZE.  Returns 1
+// on success or 0 on failure.  Always sets global 'sderror'.
+int read_sd_blocks(void *buf, unsigned long blocknum, unsigned long count);
+
+// writes each 'bufs[i]' to location 'blocknums[i]', for i < 'count'.  Each
+// buffer must be of size SOFTWARE_DISK_BLOCK_SIZE.  Runs of consecutive block
+// numbers are written with a single request.  Returns 1 on success or 0 on
+// failure.  Always sets global 'sderror'.
+int writev_sd_blocks(void **bufs, unsigned long *blocknums, unsigned long count);
+
+// reads location 'blocknums[i]' into each 'bufs[i]', for i < 'count'.  Each
+// buffer must be of size SOFTWARE_DISK_BLOCK_SIZE.  Runs of consecutive block
+// numbers are read with a single request.  Returns 1 on success or 0 on
+// failure.  Always sets global 'sderror'.
+int readv_sd_blocks(void **bufs, unsigned long *blocknums, unsigned long count);
+
+// asynchronous requests are carried out by io_uring where the kernel supports
+// it, otherwise by a pool of worker threads (always, if softwaredisk.c is
+// compiled with -DSD_NO_IO_URING), and synchronously as they are submitted by
+// the mmap backend.
+
+// submits 'count' asynchronous requests from 'reqs' and returns without
+// waiting for them.  'reqs' must stay in place until wait_sd_requests()
+// returns for them.  Returns 1 if every request was submitted, or 0 without
+// submitting any if one is out of range.  Always sets global 'sderror'.
+int submit_sd_requests(SDRequest *reqs, unsigned long count);
+
+// waits for 'count' submitted requests from 'reqs' to complete.  Returns 1 if
+// they all succeeded or 0 if any failed.  Always sets global 'sderror'.
+int wait_sd_requests(SDRequest *reqs, unsigned long count);
+
+// returns the name of the engine carrying out asynchronous requests:
+// "io_uring", "threads" or "sync".
+const char *sd_async_engine(void);
+
+// forces every block written so far out to the backing store (fdatasync, or
+// msync for the mmap backend).  Returns 1 on success or 0 on
+// failure.  Always sets global 'sderror'.
+int sync_software_disk(void);
+
+// copies the current software disk counters into 'stats'.  Every transfer
+// of a run of consecutive blocks counts as one request, however it is made.
+void get_sd_stats(SDStats *stats);
+
+// zeroes the software disk counters.
+void reset_sd_stats(void);
+
+// starts recording every request made of the backing store, as counted by
+// get_sd_stats(), to the trace file 'path', replacing any trace already being
+// recorded.  Asynchronous requests are recorded when they are submitted.
+// Returns 1 on success or 0 on failure.  Always sets global 'sderror'.
+int start_sd_trace(const char *path);
+
+// stops recording and completes the trace file.  A trace still being
+// recorded is stopped at exit, but only after exit handlers registered after
+// start_sd_trace() have run.  Returns 1 if every record was written or 0 if
+// writing the trace failed.  Always sets global 'sderror'.
+int stop_sd_trace(void);
+
+// tags the requests the calling thread makes from now on with 'caller', for
+// telling apart what the layers above asked for in a trace.  Threads start
+// out with tag 0.
+void set_sd_trace_caller(unsigned int caller);
+
 // describe current software disk error code by printing a descriptive message to
 // standard error.
 void sd_print_error(void);
 
-// software disk  error code set (set by each software disk function).
-extern SDError sderror;
\ No newline at end of file
+// software disk  error code set (set by each software disk function).  Each
+// thread has its own.
+extern __thread SDError sderror;
+
+#endif
@@ -1,7 +1,12 @@
 #!/bin/bash
-gcc -g -o formatfs formatfs.c softwaredisk.c
-gcc -g -o testfs0 testfs0.c filesystem.c softwaredisk.c && ./formatfs && ./testfs0
-gcc -g -o testfs1 testfs1.c filesystem.c softwaredisk.c && ./formatfs && ./testfs1
-gcc -g -o testfs2 testfs2.c filesystem.c softwaredisk.c && ./formatfs && ./testfs2
-gcc -g -o testfs3 testfs3.c filesystem.c softwaredisk.c && ./formatfs && ./testfs3
-gcc -g -o testfs4a testfs4a.c filesystem.c softwaredisk.c && gcc -g -o testfs4b testfs4b.c filesystem.c softwaredisk.c && ./formatfs && ./testfs4a && ./testfs4b
\ No newline at end of file
+FS_SRCS="filesystem.c blockcache.c softwaredisk.c"
+FS_LIBS="-pthread"
+gcc -g -o formatfs formatfs.c $FS_SRCS $FS_LIBS
+gcc -g -o testfs0 testfs0.c $FS_SRCS $FS_LIBS && ./formatfs && ./testfs0
+gcc -g -o testfs1 testfs1.c $FS_SRCS $FS_LIBS && ./formatfs && ./testfs1
+gcc -g -o testfs2 testfs2.c $FS_SRCS $FS_LIBS && ./formatfs && ./testfs2
+gcc -g -o testfs3 testfs3.c $FS_SRCS $FS_LIBS && ./formatfs && ./testfs3
+gcc -g -o testfs4a testfs4a.c $FS_SRCS $FS_LIBS && gcc -g -o testfs4b testfs4b.c $FS_SRCS $FS_LIBS && ./formatfs && ./testfs4a && ./testfs4b
+gcc -g -o testfs5 testfs5.c $FS_SRCS $FS_LIBS && ./formatfs && ./testfs5
+gcc -g -DSD_MMAP_BACKEND -o formatfs formatfs.c $FS_SRCS $FS_LIBS
+gcc -g -DSD_MMAP_BACKEND -o testfs0 testfs0.c $FS_SRCS $FS_LIBS && ./formatfs && ./testfs0
\ No newline at end of file
@@ -90,6 +90,22 @@ int main(int argc, char *argv[]) {
   close_file(f);
   printf("Executed close_file(f).\n");
   fs_print_error();
+
+  // should fail, file not open
+  ret=read_file(f, buf, strlen("hello"));
+  printf("ret from read_file(f, buf, strlen(\"hello\") = %d\n",
+	 ret);
+  fs_print_error();
+
+  // should fail, file not open
+  ret=seek_file(f, 10000);
+  printf("ret from seek_file(f, 10000) = %d\n", ret);
+  fs_print_error();
+
+  // should fail, file not open
+  close_file(f);
+  printf("Executed close_file(f).\n");
+  fs_print_error();
 }
   
   
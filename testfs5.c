@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "filesystem.h"
+
+// RUN formatfs before conducting this test!
+
+#define NUM_THREADS 8
+#define FILES_PER_THREAD 16
+#define MAX_LEN 20000
+
+// tests concurrent use of the filesystem: each thread creates, writes and
+// reads back its own files, and every thread races to create one shared file
+
+static int created_shared;
+static pthread_mutex_t created_lock=PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long file_len(int t, int i) {
+  return (t * 7919 + i * 104729) % MAX_LEN + 1;
+}
+
+static void fill(unsigned char *buf, unsigned long len, int t, int i) {
+  unsigned long j;
+  for (j=0; j < len; j++) {
+    buf[j]=(unsigned char)(j * 31 + t * 17 + i);
+  }
+}
+
+static void *worker(void *arg) {
+  int t=(int)(long)arg, i, errors=0;
+  char name[64];
+  unsigned char *buf=malloc(MAX_LEN), *buf2=malloc(MAX_LEN);
+  unsigned long len, ret;
+  File f;
+
+  f=create_file("shared");
+  if (f) {
+    pthread_mutex_lock(&created_lock);
+    created_shared++;
+    pthread_mutex_unlock(&created_lock);
+    close_file(f);
+  }
+  else if (fserror != FS_FILE_ALREADY_EXISTS && fserror != FS_FILE_OPEN) {
+    printf("Thread %d: unexpected error creating shared file: ", t);
+    fs_print_error();
+    errors++;
+  }
+
+  for (i=0; i < FILES_PER_THREAD; i++) {
+    sprintf(name, "thread%d-file%d", t, i);
+    len=file_len(t, i);
+    fill(buf, len, t, i);
+    f=create_file(name);
+    if (! f) {
+      printf("Thread %d: create_file(\"%s\") failed: ", t, name);
+      fs_print_error();
+      errors++;
+      continue;
+    }
+    // two writes, so the second starts part way into a block
+    ret=write_file(f, buf, len / 3);
+    ret += write_file(f, buf + len / 3, len - len / 3);
+    if (ret != len) {
+      printf("Thread %d: wrote %lu of %lu bytes to \"%s\"\n", t, ret, len, name);
+      errors++;
+    }
+    close_file(f);
+  }
+
+  for (i=0; i < FILES_PER_THREAD; i++) {
+    sprintf(name, "thread%d-file%d", t, i);
+    len=file_len(t, i);
+    fill(buf, len, t, i);
+    f=open_file(name, READ_ONLY);
+    if (! f) {
+      printf("Thread %d: open_file(\"%s\") failed: ", t, name);
+      fs_print_error();
+      errors++;
+      continue;
+    }
+    ret=read_file(f, buf2, MAX_LEN);
+    if (ret != len || memcmp(buf, buf2, len)) {
+      printf("Thread %d: contents of \"%s\" don't match\n", t, name);
+      errors++;
+    }
+    close_file(f);
+    if (i % 2 == 0 && ! delete_file(name)) {
+      printf("Thread %d: delete_file(\"%s\") failed: ", t, name);
+      fs_print_error();
+      errors++;
+    }
+  }
+
+  free(buf);
+  free(buf2);
+  return (void *)(long)errors;
+}
+
+int main(int argc, char *argv[]) {
+  pthread_t threads[NUM_THREADS];
+  void *errors;
+  int t, total=0, remaining=0, i;
+  char name[64];
+
+  for (t=0; t < NUM_THREADS; t++) {
+    pthread_create(&threads[t], NULL, worker, (void *)(long)t);
+  }
+  for (t=0; t < NUM_THREADS; t++) {
+    pthread_join(threads[t], &errors);
+    total += (int)(long)errors;
+  }
+
+  printf("Shared file created by %d thread(s).\n", created_shared);
+  for (t=0; t < NUM_THREADS; t++) {
+    for (i=0; i < FILES_PER_THREAD; i++) {
+      sprintf(name, "thread%d-file%d", t, i);
+      remaining += file_exists(name);
+    }
+  }
+  printf("%d of %d files remain after deleting half.\n", remaining,
+	 NUM_THREADS * FILES_PER_THREAD);
+
+  printf("Concurrent create / write / read %s.\n",
+	 total == 0 && created_shared == 1 &&
+	 remaining == NUM_THREADS * FILES_PER_THREAD / 2 ? "matches" : "doesn't match");
+
+  return 0;
+}